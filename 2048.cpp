@@ -11,20 +11,106 @@
 #include <fstream>
 #include <iterator>
 #include <string>
+#include <vector>
 #include "board.h"
 #include "action.h"
 #include "agent.h"
 #include "episode.h"
 #include "statistic.h"
+#include "profiler.h"
 
-int main(int argc, const char* argv[]) {
+/**
+ * play episodes in lockstep, i.e., advance 'batch' independent episodes (slots) together
+ * on one thread, so that the player takes the actions of all its slots at once
+ * each slot makes one move per round, and is refilled with a new episode when it ends
+ */
+void lockstep(statistic& stat, agent& play, agent& evil, size_t batch) {
+	std::vector<episode> games(batch);
+	std::vector<bool> live(batch, false);
+	std::vector<size_t> slots;
+	std::vector<board> states;
+	std::vector<action> moves;
+	size_t active = 0;
+
+	auto finish = [&](size_t s) {
+		episode& game = games[s];
+		agent& win = game.last_turns(play, evil);
+		game.close_episode(win.name());
+		stat.close_episode(game);
+		play.switch_slot(s);
+		evil.switch_slot(s);
+		{
+			TIMED(counter::update_ns);
+			profiler::scope hw(profiler::update);
+			play.close_episode(win.name());
+		}
+		evil.close_episode(win.name());
+		live[s] = false;
+		active--;
+	};
+	auto advance = [&](size_t s, agent& who, action move) {
+		episode& game = games[s];
+		if (game.apply_action(move) != true || who.check_for_win(game.state())) finish(s);
+	};
+
+	while (true) {
+		for (size_t s = 0; s < batch; s++) {
+			if (live[s] || active >= stat.remain()) continue;
+			play.switch_slot(s);
+			evil.switch_slot(s);
+			play.open_episode("~:" + evil.name());
+			evil.open_episode(play.name() + ":~");
+			games[s].clear();
+			games[s].open_episode(play.name() + ":" + evil.name());
+			live[s] = true;
+			active++;
+		}
+		if (active == 0) break;
+
+		slots.clear();
+		states.clear();
+		for (size_t s = 0; s < batch; s++) {
+			if (!live[s]) continue;
+			agent& who = games[s].take_turns(play, evil);
+			if (&who == &play) {
+				slots.push_back(s);
+				states.push_back(games[s].state());
+			} else {
+				evil.switch_slot(s);
+				action move;
+				{
+					TIMED(counter::environment_ns);
+					move = evil.take_action(games[s].state());
+				}
+				advance(s, evil, move);
+			}
+		}
+		if (slots.empty()) continue;
+		time_t start = episode::clock();
+		{
+			TIMED(counter::select_ns);
+			profiler::scope hw(profiler::select);
+			play.take_actions(slots, states, moves);
+		}
+		time_t share = (episode::clock() - start) / slots.size(); // each slot is charged its share of the batch
+		for (size_t i = 0; i < slots.size(); i++) {
+			games[slots[i]].charge_turn(share);
+			play.switch_slot(slots[i]);
+			advance(slots[i], play, moves[i]);
+		}
+	}
+}
+
+int main(int argc, const char* argv[]) try {
 	std::cout << "2048-Demo: ";
 	std::copy(argv, argv + argc, std::ostream_iterator<const char*>(std::cout, " "));
 	std::cout << std::endl << std::endl;
 
-	size_t total = 1000, block = 0, limit = 0;
+	size_t total = 1000, block = 0, limit = 0, batch = 1;
 	std::string play_args, evil_args;
 	std::string load, save;
+	std::string stats_out, stats_format;
+	bool profile = false;
 	bool summary = false;
 	for (int i = 1; i < argc; i++) {
 		std::string para(argv[i]);
@@ -34,6 +120,8 @@ int main(int argc, const char* argv[]) {
 			block = std::stoull(para.substr(para.find("=") + 1));
 		} else if (para.find("--limit=") == 0) {
 			limit = std::stoull(para.substr(para.find("=") + 1));
+		} else if (para.find("--batch=") == 0) {
+			batch = std::stoull(para.substr(para.find("=") + 1));
 		} else if (para.find("--play=") == 0) {
 			play_args = para.substr(para.find("=") + 1);
 		} else if (para.find("--evil=") == 0) {
@@ -42,6 +130,14 @@ int main(int argc, const char* argv[]) {
 			load = para.substr(para.find("=") + 1);
 		} else if (para.find("--save=") == 0) {
 			save = para.substr(para.find("=") + 1);
+		} else if (para.find("--timing=") == 0) {
+			episode::timing() = para.substr(para.find("=") + 1) != "off";
+		} else if (para.find("--stats-out=") == 0) {
+			stats_out = para.substr(para.find("=") + 1);
+		} else if (para.find("--stats-format=") == 0) {
+			stats_format = para.substr(para.find("=") + 1);
+		} else if (para.find("--profile") == 0) {
+			profile = true;
 		} else if (para.find("--summary") == 0) {
 			summary = true;
 		}
@@ -50,14 +146,26 @@ int main(int argc, const char* argv[]) {
 	statistic stat(total, block, limit);
 
 	if (load.size()) {
-		std::ifstream in(load, std::ios::in);
-		in >> stat;
-		in.close();
+		stat.load(load, save.size());
 		summary |= stat.is_finished();
 	}
 
+	if (save.size()) {
+		stat.stream(save);
+	}
+
+	if (stats_out.size() || stats_format.size()) {
+		bool csv = stats_out.size() >= 4 && stats_out.compare(stats_out.size() - 4, 4, ".csv") == 0;
+		stat.export_stats(stats_out, stats_format.size() ? stats_format : csv ? "csv" : "json");
+	}
+
 	TD_player play(play_args);
 	rndenv evil(evil_args);
+	stat.subscribe(play);
+
+	if (profile) profiler::instance().open();
+
+	if (batch > 1) lockstep(stat, play, evil, batch);
 
 	while (!stat.is_finished()) {
 		play.open_episode("~:" + evil.name());
@@ -67,14 +175,23 @@ int main(int argc, const char* argv[]) {
 		episode& game = stat.back();
 		while (true) {
 			agent& who = game.take_turns(play, evil);
-			action move = who.take_action(game.state());
+			action move;
+			{
+				TIMED(&who == &play ? counter::select_ns : counter::environment_ns);
+				profiler::scope hw(&who == &play ? profiler::select : profiler::none);
+				move = who.take_action(game.state());
+			}
 			if (game.apply_action(move) != true) break;
 			if (who.check_for_win(game.state())) break;
 		}
 		agent& win = game.last_turns(play, evil);
 		stat.close_episode(win.name());
 
-		play.close_episode(win.name());
+		{
+			TIMED(counter::update_ns);
+			profiler::scope hw(profiler::update);
+			play.close_episode(win.name());
+		}
 		evil.close_episode(win.name());
 	}
 
@@ -82,11 +199,11 @@ int main(int argc, const char* argv[]) {
 		stat.summary();
 	}
 
-	if (save.size()) {
-		std::ofstream out(save, std::ios::out | std::ios::trunc);
-		out << stat;
-		out.close();
-	}
+	stat.close_stream();
+	play.save();
 
 	return 0;
+} catch (std::exception& e) {
+	std::cerr << e.what() << std::endl;
+	return -1;
 }
@@ -23,11 +23,11 @@ public:
 	class place; // create a placing action with position and tile
 
 public:
-	virtual board::reward apply(board& b) const {
-		auto proto = entries().find(type());
-		if (proto != entries().end()) return proto->second->reinterpret(this).apply(b);
-		return -1;
-	}
+	/**
+	 * apply the action by switching on its type, see the definition below the subclasses;
+	 * the prototypes in entries() are only for printing and parsing
+	 */
+	board::reward apply(board& b) const;
 	virtual std::ostream& operator >>(std::ostream& out) const {
 		auto proto = entries().find(type());
 		if (proto != entries().end()) return proto->second->reinterpret(this) >> out;
@@ -124,3 +124,11 @@ protected:
 	action& reinterpret(const action* a) const { return *new (const_cast<action*>(a)) place(*a); }
 	static __attribute__((constructor)) void init() { entries()[type_flag('p')] = new place; }
 };
+
+inline board::reward action::apply(board& b) const {
+	switch (type()) {
+	case slide::type: return slide(*this).apply(b);
+	case place::type: return place(*this).apply(b);
+	default:          return -1;
+	}
+}
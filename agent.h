@@ -14,10 +14,22 @@
 #include <map>
 #include <type_traits>
 #include <algorithm>
+#include <vector>
+#include <limits>
+#include <memory>
+#include <cmath>
+#include <cstdlib>
 #include "board.h"
 #include "action.h"
 #include "weight.h"
+#include "rng.h"
+#include "replay.h"
 #include <fstream>
+#include <stdexcept>
+#include <chrono>
+#if defined(__BMI2__)
+#include <immintrin.h>
+#endif
 
 class agent {
 public:
@@ -35,6 +47,22 @@ public:
 	virtual action take_action(const board& b) { return action(); }
 	virtual bool check_for_win(const board& b) { return false; }
 
+	/**
+	 * bind the agent to one of the episodes played in lockstep (see lockstep in 2048.cpp),
+	 * where an agent with per-episode state keeps a copy of the state for each slot
+	 */
+	virtual void switch_slot(size_t slot) {}
+	/**
+	 * take the actions of several slots at once, moves[i] for before[i] in slots[i]
+	 */
+	virtual void take_actions(const std::vector<size_t>& slots, const std::vector<board>& before, std::vector<action>& moves) {
+		moves.resize(before.size());
+		for (size_t i = 0; i < before.size(); i++) {
+			switch_slot(slots[i]);
+			moves[i] = take_action(before[i]);
+		}
+	}
+
 public:
 	virtual std::string property(const std::string& key) const { return meta.at(key); }
 	virtual void notify(const std::string& msg) { meta[msg.substr(0, msg.find('='))] = { msg.substr(msg.find('=') + 1) }; }
@@ -54,66 +82,477 @@ protected:
 
 /**
  * base agent for agents with randomness
+ *
+ * the engine is selected by 'rng' (see rng.h), and is reseeded for every episode
+ * from 'seed' and the episode index, which counts the opened episodes by default;
+ * a driver running episodes on several threads sets the index by notify("episode=i")
  */
 class random_agent : public agent {
 public:
-	random_agent(const std::string& args = "") : agent(args) {
+	random_agent(const std::string& args = "") : agent(args), seed(0), episode(0), slot(0) {
+		if (meta.find("rng") != meta.end())
+			engine = rng(meta["rng"]);
 		if (meta.find("seed") != meta.end())
-			engine.seed(int(meta["seed"]));
+			seed = std::stoull(meta["seed"]);
+		engine.reseed(seed, episode);
 	}
 	virtual ~random_agent() {}
 
+	virtual void open_episode(const std::string& flag = "") {
+		engine.reseed(seed, episode++);
+	}
+	virtual void notify(const std::string& msg) {
+		agent::notify(msg);
+		if (msg.find("episode=") == 0) episode = std::stoull(msg.substr(msg.find('=') + 1));
+	}
+	virtual void switch_slot(size_t s) {
+		if (std::max(s, slot) >= stash.size()) stash.resize(std::max(s, slot) + 1, engine); // new slots keep the selected kind of engine
+		stash[slot] = engine;
+		engine = stash[s];
+		slot = s;
+	}
+
 protected:
-	std::default_random_engine engine;
+	rng engine;
+	uint64_t seed;
+	uint64_t episode;
+	std::vector<rng> stash;
+	size_t slot;
 };
 
 /**
  * base agent for agents with weight tables and a learning rate
+ *
+ * if 'tc' (or 'tc-load' or 'tc-save') is given, the learning rate of each entry is adapted by temporal coherence (TC),
+ * with the accumulators kept in tables parallel to the weight tables (see coherence),
+ * which are loaded from 'tc-load' and saved to 'tc-save', apart from the weights
+ *
+ * the learning rate follows a 'schedule', which is applied at the end of each statistic block
+ * as reported by notify("block=episodes,avg") (see statistic::subscribe):
+ *  "step": multiply alpha by 'decay' (0.5 by default) once the episodes reach each of 'at', e.g., at=100000,200000
+ *  "plateau": multiply alpha by 'decay' after 'patience' blocks (3 by default) without a better block average
+ *  "cosine": anneal alpha from its initial value to 'alpha-min' (0 by default) over 'period' episodes
+ * where alpha never drops below 'alpha-min'; alpha can also be set directly by notify("alpha=value"),
+ * which also replaces the initial value that the cosine schedule anneals from
+ *
+ * if 'stages' is given, e.g., stages=15,17, the network has one set of tables for each stage of the game,
+ * where the stage of a board is the number of boundaries (tile indices) not above its largest tile,
+ * e.g., a board whose largest tile is 987 (index 15) is in stage 1 of 3; the boundaries are saved in the weight file
  */
 class weight_agent : public agent {
 public:
-	weight_agent(const std::string& args = "") : agent(args), alpha(0) {
+	weight_agent(const std::string& args = "") : agent(args), alpha(0), origin(0),
+			alpha0(0), alpha_min(0), decay(0.5), patience(3), period(0), best(0), stale(0) {
+		if (meta.find("stages") != meta.end())
+			init_stages(meta["stages"]);
 		if (meta.find("init") != meta.end())
 			init_weights(meta["init"]);
 		if (meta.find("load") != meta.end())
 			load_weights(meta["load"]);
 		if (meta.find("alpha") != meta.end())
 			alpha = float(meta["alpha"]);
+		if (meta.find("tc") != meta.end() || meta.find("tc-load") != meta.end() || meta.find("tc-save") != meta.end())
+			init_coherence();
+		if (meta.find("tc-load") != meta.end())
+			load_coherence(meta["tc-load"]);
+		if (meta.find("schedule") != meta.end())
+			init_schedule(meta["schedule"]);
 	}
+	/**
+	 * save the weights and the accumulators if not yet saved by save(), where a failure
+	 * still ends the process with an error, since a destructor cannot throw
+	 */
 	virtual ~weight_agent() {
+		if (saved) return;
+		try {
+			weight_agent::save();
+		} catch (std::exception& e) {
+			std::cerr << e.what() << std::endl;
+			std::exit(-1);
+		}
+	}
+
+	/**
+	 * save the weights to 'save' and the accumulators to 'tc-save' if given, which throws on failure
+	 */
+	virtual void save() {
+		saved = true;
 		if (meta.find("save") != meta.end())
 			save_weights(meta["save"]);
+		if (meta.find("tc-save") != meta.end())
+			save_coherence(meta["tc-save"]);
+	}
+
+	virtual void notify(const std::string& msg) {
+		if (msg.find("block=") == 0) { // a report, which is not kept as a property
+			std::string report = msg.substr(msg.find('=') + 1);
+			size_t episodes = std::stoull(report.substr(0, report.find(',')));
+			double avg = std::stod(report.substr(report.find(',') + 1));
+			step_schedule(episodes, avg);
+			return;
+		}
+		agent::notify(msg);
+		if (msg.find("alpha=") == 0) alpha = alpha0 = float(meta["alpha"]); // also the peak of the cosine schedule
 	}
 
 protected:
+	void init_schedule(const std::string& type) {
+		if (type != "step" && type != "plateau" && type != "cosine")
+			throw std::invalid_argument("unknown schedule " + type);
+		schedule = type;
+		alpha0 = alpha;
+		if (meta.find("alpha-min") != meta.end()) alpha_min = float(meta["alpha-min"]);
+		if (meta.find("decay") != meta.end()) decay = float(meta["decay"]);
+		if (meta.find("patience") != meta.end()) patience = size_t(meta["patience"]);
+		if (meta.find("period") != meta.end()) period = size_t(meta["period"]);
+		if (meta.find("at") != meta.end()) {
+			std::stringstream list(meta["at"]);
+			for (std::string at; std::getline(list, at, ','); )
+				if (at.size()) milestones.push_back(std::stoull(at));
+			std::sort(milestones.begin(), milestones.end());
+		}
+		if (schedule == "step" && milestones.empty()) throw std::invalid_argument("schedule=step needs at=episodes,...");
+		if (schedule == "cosine" && period == 0) throw std::invalid_argument("schedule=cosine needs period=episodes");
+		if (decay <= 0 || decay > 1) throw std::invalid_argument("decay must be in (0, 1]");
+	}
+
+	/**
+	 * apply the schedule at the end of a block, given the episodes so far and the block average
+	 */
+	void step_schedule(size_t episodes, double avg) {
+		float last = alpha;
+		if (schedule == "step") {
+			while (milestones.size() && episodes >= milestones.front()) {
+				alpha *= decay;
+				milestones.erase(milestones.begin());
+			}
+		} else if (schedule == "plateau") {
+			if (avg > best) {
+				best = avg;
+				stale = 0;
+			} else if (++stale >= patience) {
+				alpha *= decay;
+				stale = 0;
+			}
+		} else if (schedule == "cosine") {
+			double progress = std::min(double(episodes) / period, 1.0);
+			alpha = alpha_min + (alpha0 - alpha_min) * 0.5 * (1 + std::cos(progress * 3.14159265358979323846));
+		} else {
+			return;
+		}
+		alpha = std::max(alpha, alpha_min);
+		if (alpha != last && schedule != "cosine") std::cout << "\t" "alpha = " << alpha << std::endl;
+	}
+
 	virtual void init_weights(const std::string& info) {
-		for(int i = 1 ; i <= 24 ; i++)
-			net.emplace_back(31 * 31 * 31 * 31 * 31);
+		static const std::vector<std::vector<unsigned>> patterns = {
+			{ 0, 1, 2, 3, 4 }, { 5, 6, 7, 10, 11 }, { 8, 9, 12, 13, 14 },
+			{ 0, 1, 2, 3, 7 }, { 4, 5, 6, 8, 9 }, { 10, 11, 13, 14, 15 },
+			{ 1, 2, 3, 6, 7 }, { 4, 5, 8, 9, 10 }, { 11, 12, 13, 14, 15 },
+			{ 0, 1, 2, 4, 5 }, { 6, 7, 9, 10, 11 }, { 8, 12, 13, 14, 15 },
+			{ 0, 4, 8, 12, 13 }, { 1, 2, 5, 6, 9 }, { 7, 10, 11, 14, 15 },
+			{ 0, 1, 4, 8, 12 }, { 5, 9, 10, 13, 14 }, { 2, 3, 6, 7, 11 },
+			{ 2, 3, 7, 11, 15 }, { 6, 9, 10, 13, 14 }, { 0, 1, 4, 5, 8 },
+			{ 3, 7, 11, 14, 15 }, { 1, 2, 5, 6, 10 }, { 4, 8, 9, 12, 13 },
+			{ 0, 1, 2, 3 }, { 4, 5, 6, 7 }, { 8, 9, 10, 11 }, { 12, 13, 14, 15 },
+			{ 0, 4, 8, 12 }, { 1, 5, 9, 13 }, { 2, 6, 10, 14 }, { 3, 7, 11, 15 },
+		};
+		net.clear();
+		net.reserve(patterns.size() * stages()); // no copy on growth, which would touch every page
+		for (size_t s = 0; s < stages(); s++)
+			for (auto& cells : patterns)
+				net.emplace_back(cells, 31);
+	}
 
-		for(int i = 1 ; i <= 8 ; i++)
-			net.emplace_back(31 * 31 * 31 * 31);
+	void init_stages(const std::string& list) {
+		std::stringstream in(list);
+		bounds.clear();
+		for (std::string bound; std::getline(in, bound, ','); )
+			if (bound.size()) bounds.push_back(std::stoul(bound));
+		if (!valid(bounds)) throw std::invalid_argument("stages must be increasing tile indices in [1, " + std::to_string(max_tile) + "]");
 	}
-	virtual void load_weights(const std::string& path) {
-		std::ifstream in(path, std::ios::in | std::ios::binary);
-		if (!in.is_open()) std::exit(-1);
-		uint32_t size;
+
+	/**
+	 * whether the stage boundaries are increasing and each of them can be reached, where a boundary of 0
+	 * would leave stage 0 empty and a boundary above the largest tile index would leave its stage empty
+	 */
+	static bool valid(const std::vector<uint32_t>& bounds) {
+		for (size_t i = 0; i < bounds.size(); i++)
+			if (bounds[i] < 1 || bounds[i] > max_tile || (i && bounds[i] <= bounds[i - 1])) return false;
+		return true;
+	}
+
+	/**
+	 * the first table of the stage of a board, where each stage has net.size() / stages() tables
+	 */
+	size_t stage(const board& b) const {
+		if (bounds.empty()) return 0;
+		board::cell top = 0;
+		for (int i = 0; i < 16; i++) top = std::max(top, b(i));
+		size_t s = 0;
+		while (s < bounds.size() && top >= bounds[s]) s++;
+		return s * (net.size() / stages());
+	}
+	size_t stages() const { return bounds.size() + 1; }
+
+	static std::string describe(const std::vector<uint32_t>& bounds) {
+		std::string list;
+		for (uint32_t b : bounds) list += (list.size() ? "," : "") + std::to_string(b);
+		return "(" + list + ")";
+	}
+
+	/**
+	 * the header of a weight file, all fields are in native byte order
+	 *
+	 * char     magic[8]   "NTWEIGHT"
+	 * uint32_t version    format version, currently 4
+	 * uint32_t endian     0x01020304 as written, to detect the other byte order
+	 * uint32_t dtype      element type, 1 for 32-bit IEEE float
+	 * uint32_t codec      codec of the table records, 0 for plain, 1 for sparse, 2 for delta (since version 2)
+	 * uint64_t id         identity of this snapshot (since version 3)
+	 * uint64_t origin     identity of the full snapshot a delta applies to, 0 for a full snapshot (since version 3)
+	 * uint32_t bounds     number of stage boundaries, 0 for a single-stage network (since version 4)
+	 * uint32_t bound[]    the stage boundaries, i.e., tile indices in increasing order (since version 4)
+	 * uint32_t count      number of tables, which are the tables of stage 0, then stage 1, and so on,
+	 *                     followed by the table records (see weight.h)
+	 *
+	 * the tables are saved as sparse if 'compress' is given, and sparse tables are
+	 * encoded and decoded by 'threads' threads (all hardware threads by default)
+	 *
+	 * if 'delta' is given, only the pages changed since the last full snapshot (loaded or saved)
+	 * are saved; a snapshot is rebuilt by loading a list of files, e.g., "load=full.bin,delta.bin"
+	 *
+	 * a file without the magic is read as the legacy format (a bare uint32_t count
+	 * followed by bare tables), which must match the network built by init_weights
+	 *
+	 * the tables in the file define the network, unless the network has been initialized,
+	 * in which case the tables must match it
+	 */
+	virtual void load_weights(const std::string& paths) {
+		std::stringstream list(paths);
+		for (std::string path; std::getline(list, path, ','); ) {
+			if (path.empty()) continue;
+			std::ifstream in(path, std::ios::in | std::ios::binary);
+			if (!in.is_open()) throw std::runtime_error("weight file " + path + ": cannot open");
+			try {
+				load_snapshot(in);
+			} catch (std::exception& e) {
+				throw std::runtime_error("weight file " + path + ": " + e.what());
+			}
+		}
+	}
+	virtual void save_weights(const std::string& path) {
+		std::ofstream out(path, std::ios::out | std::ios::binary | std::ios::trunc);
+		if (!out.is_open()) throw std::runtime_error("weight file " + path + ": cannot open");
+		uint32_t version = file_version, endian = file_endian, dtype = file_dtype, size = net.size();
+		uint32_t codec = (meta.find("compress") != meta.end()) ? weight::sparse : weight::plain;
+		uint64_t id = identity(), from = 0;
+		if (meta.find("delta") != meta.end()) {
+			if (origin == 0) throw std::runtime_error("weight file " + path + ": no full snapshot to take a delta from");
+			codec = weight::delta;
+			from = origin;
+		}
+		out.write(file_magic, 8);
+		out.write(reinterpret_cast<char*>(&version), sizeof(version));
+		out.write(reinterpret_cast<char*>(&endian), sizeof(endian));
+		out.write(reinterpret_cast<char*>(&dtype), sizeof(dtype));
+		out.write(reinterpret_cast<char*>(&codec), sizeof(codec));
+		out.write(reinterpret_cast<char*>(&id), sizeof(id));
+		out.write(reinterpret_cast<char*>(&from), sizeof(from));
+		uint32_t stage = bounds.size();
+		out.write(reinterpret_cast<char*>(&stage), sizeof(stage));
+		out.write(reinterpret_cast<const char*>(bounds.data()), sizeof(uint32_t) * stage);
+		out.write(reinterpret_cast<char*>(&size), sizeof(size));
+		for (weight& w : net) w.write(out, weight::codec(codec), threads());
+		out.close();
+		if (!out) throw std::runtime_error("weight file " + path + ": write failed");
+		if (codec == weight::delta) return;
+		for (weight& w : net) w.clean();
+		origin = id;
+	}
+
+	void load_snapshot(std::istream& in) {
+		char magic[8] = {};
+		in.read(magic, sizeof(magic));
+		if (!in || std::string(magic, sizeof(magic)) != file_magic) {
+			in.clear();
+			in.seekg(0);
+			load_legacy(in);
+			return;
+		}
+		uint32_t version = 0, endian = 0, dtype = 0, codec = weight::plain, size = 0;
+		uint64_t id = 0, from = 0;
+		in.read(reinterpret_cast<char*>(&version), sizeof(version));
+		in.read(reinterpret_cast<char*>(&endian), sizeof(endian));
+		in.read(reinterpret_cast<char*>(&dtype), sizeof(dtype));
+		if (version >= 2) in.read(reinterpret_cast<char*>(&codec), sizeof(codec));
+		if (version >= 3) in.read(reinterpret_cast<char*>(&id), sizeof(id));
+		if (version >= 3) in.read(reinterpret_cast<char*>(&from), sizeof(from));
+		uint32_t stage = 0;
+		if (version >= 4) in.read(reinterpret_cast<char*>(&stage), sizeof(stage));
+		if (stage > max_tile) throw std::runtime_error("has " + std::to_string(stage) + " stage boundaries");
+		std::vector<uint32_t> bound(stage);
+		in.read(reinterpret_cast<char*>(bound.data()), sizeof(uint32_t) * stage);
 		in.read(reinterpret_cast<char*>(&size), sizeof(size));
+		if (!in) throw std::runtime_error("header is truncated");
+		if (!valid(bound)) throw std::runtime_error("has bad stages " + describe(bound));
+		if (version < 1 || version > file_version)
+			throw std::runtime_error("unsupported version " + std::to_string(version));
+		if (codec != weight::plain && codec != weight::sparse && codec != weight::delta)
+			throw std::runtime_error("unsupported codec " + std::to_string(codec));
+		if (endian != file_endian)
+			throw std::runtime_error("byte order differs from this machine");
+		if (dtype != file_dtype)
+			throw std::runtime_error("unsupported element type " + std::to_string(dtype));
+		if ((net.size() || meta.find("stages") != meta.end()) && bound != bounds)
+			throw std::runtime_error("has stages " + describe(bound) + ", expected " + describe(bounds));
+		if (size % (stage + 1) != 0)
+			throw std::runtime_error("has " + std::to_string(size) + " tables, not divisible into " + std::to_string(stage + 1) + " stages");
+		if (net.size() && net.size() != size)
+			throw std::runtime_error("has " + std::to_string(size) + " tables, expected " + std::to_string(net.size()));
+		if (codec == weight::delta) {
+			if (origin == 0 || from != origin)
+				throw std::runtime_error("delta of snapshot " + std::to_string(from) + " does not apply to " + std::to_string(origin));
+			for (weight& w : net) w.patch(in);
+			return;
+		}
+		bounds = bound;
 		net.resize(size);
-		for (weight& w : net) in >> w;
-		in.close();
+		for (size_t i = 0; i < net.size(); i++) {
+			weight w;
+			w.read(in, weight::codec(codec), threads());
+			if (net[i].size() && !net[i].conform(w))
+				throw std::runtime_error("table " + std::to_string(i) + " is " + w.signature() + ", expected " + net[i].signature());
+			net[i] = std::move(w);
+		}
+		origin = id;
 	}
-	virtual void save_weights(const std::string& path) {
+
+	/**
+	 * the TC accumulators, where the table coherence[t] has two entries for each entry i of net[t],
+	 * i.e., the sum of the errors at 2i and the sum of the absolute errors at 2i + 1, so that
+	 * both share a cache line; the learning rate of entry i is alpha * |E| / A (alpha if A = 0)
+	 */
+	void init_coherence() {
+		if (net.empty()) throw std::runtime_error("tc: the network is not initialized");
+		coherence.clear();
+		coherence.reserve(net.size()); // no copy on growth, which would touch every page
+		for (const weight& w : net) coherence.emplace_back(2 * w.size());
+	}
+
+	/**
+	 * the accumulator file, all fields are in native byte order
+	 *
+	 * char     magic[8]   "NTCOHERE"
+	 * uint32_t endian     0x01020304 as written
+	 * uint32_t bounds     number of stage boundaries of the network
+	 * uint32_t bound[]    the stage boundaries, which must match the network on loading
+	 * uint32_t count      number of tables, followed by sparse table records (see weight.h)
+	 */
+	void load_coherence(const std::string& path) {
+		std::ifstream in(path, std::ios::in | std::ios::binary);
+		if (!in.is_open()) throw std::runtime_error("accumulator file " + path + ": cannot open");
+		char magic[8] = {};
+		uint32_t endian = 0, stage = 0, size = 0;
+		in.read(magic, sizeof(magic));
+		in.read(reinterpret_cast<char*>(&endian), sizeof(endian));
+		if (!in || std::string(magic, sizeof(magic)) != tc_magic)
+			throw std::runtime_error("accumulator file " + path + ": not an accumulator file");
+		if (endian != file_endian)
+			throw std::runtime_error("accumulator file " + path + ": byte order differs from this machine");
+		in.read(reinterpret_cast<char*>(&stage), sizeof(stage));
+		if (!in || stage > max_tile)
+			throw std::runtime_error("accumulator file " + path + ": has " + std::to_string(stage) + " stage boundaries");
+		std::vector<uint32_t> bound(stage);
+		in.read(reinterpret_cast<char*>(bound.data()), sizeof(uint32_t) * stage);
+		in.read(reinterpret_cast<char*>(&size), sizeof(size));
+		if (!in)
+			throw std::runtime_error("accumulator file " + path + ": header is truncated");
+		if (bound != bounds)
+			throw std::runtime_error("accumulator file " + path + ": has stages " + describe(bound) + ", expected " + describe(bounds));
+		if (size != coherence.size())
+			throw std::runtime_error("accumulator file " + path + ": has " + std::to_string(size) + " tables, expected " + std::to_string(coherence.size()));
+		for (size_t i = 0; i < coherence.size(); i++) {
+			weight w;
+			w.read(in, weight::sparse, threads());
+			if (!in || w.size() != coherence[i].size())
+				throw std::runtime_error("accumulator file " + path + ": table " + std::to_string(i) + " does not match the network");
+			coherence[i] = std::move(w);
+		}
+	}
+	void save_coherence(const std::string& path) {
 		std::ofstream out(path, std::ios::out | std::ios::binary | std::ios::trunc);
-		if (!out.is_open()) std::exit(-1);
-		uint32_t size = net.size();
+		if (!out.is_open()) throw std::runtime_error("accumulator file " + path + ": cannot open");
+		uint32_t endian = file_endian, stage = bounds.size(), size = coherence.size();
+		out.write(tc_magic, 8);
+		out.write(reinterpret_cast<char*>(&endian), sizeof(endian));
+		out.write(reinterpret_cast<char*>(&stage), sizeof(stage));
+		out.write(reinterpret_cast<const char*>(bounds.data()), sizeof(uint32_t) * stage);
 		out.write(reinterpret_cast<char*>(&size), sizeof(size));
-		for (weight& w : net) out << w;
+		for (weight& w : coherence) w.write(out, weight::sparse, threads());
 		out.close();
+		if (!out) throw std::runtime_error("accumulator file " + path + ": write failed");
 	}
 
+	/**
+	 * a random identity for a new snapshot
+	 */
+	static uint64_t identity() {
+		std::random_device dev;
+		uint64_t id = (uint64_t(dev()) << 32) ^ dev() ^ std::chrono::system_clock::now().time_since_epoch().count();
+		return id ? id : 1;
+	}
+
+	unsigned threads() const {
+		auto it = meta.find("threads");
+		if (it != meta.end()) return std::max(unsigned(it->second), 1u);
+		return std::max(std::thread::hardware_concurrency(), 1u);
+	}
+
+	/**
+	 * convert a legacy file, whose tables carry no descriptor, onto the initialized network
+	 */
+	void load_legacy(std::istream& in) {
+		if (net.empty()) init_weights("");
+		uint32_t size = 0;
+		in.read(reinterpret_cast<char*>(&size), sizeof(size));
+		if (!in) throw std::runtime_error("not a weight file");
+		if (size != net.size())
+			throw std::runtime_error("legacy file has " + std::to_string(size) + " tables, expected " + std::to_string(net.size()));
+		for (size_t i = 0; i < net.size(); i++) {
+			weight w = weight::legacy(in);
+			if (w.size() != net[i].size())
+				throw std::runtime_error("legacy table " + std::to_string(i) + " has " + std::to_string(w.size()) +
+					" entries, expected " + std::to_string(net[i].size()) + " for " + net[i].signature());
+			net[i].adopt(std::move(w));
+		}
+	}
+
+protected:
+	static constexpr const char* file_magic = "NTWEIGHT";
+	static constexpr uint32_t file_version = 4;
+	static constexpr uint32_t file_endian = 0x01020304;
+	static constexpr uint32_t file_dtype = 1;
+	static constexpr const char* tc_magic = "NTCOHERE";
+	static constexpr uint32_t max_tile = 30; // the largest tile index, i.e., 1346269 (see board::fib)
+
 protected:
 	std::vector<weight> net;
+	std::vector<uint32_t> bounds; // the stage boundaries
+	std::vector<weight> coherence;
 	float alpha;
+	uint64_t origin;
+
+	std::string schedule;
+	float alpha0;
+	float alpha_min;
+	float decay;
+	size_t patience;
+	size_t period;
+	std::vector<size_t> milestones;
+	double best;
+	size_t stale;
+	bool saved = false;
 };
 
 /**
@@ -121,25 +560,36 @@ protected:
  * add a new random tile to an empty cell
  * 2-tile: 90%
  * 4-tile: 10%
+ *
+ * a single draw in [0, 10 * empty) picks both the empty cell (draw / 10)
+ * and the tile (draw % 10, where 0 is the 4-tile)
  */
 class rndenv : public random_agent {
 public:
-	rndenv(const std::string& args = "") : random_agent("name=random role=environment " + args),
-		space({ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 }), popup(0, 9) {}
+	rndenv(const std::string& args = "") : random_agent("name=random role=environment " + args) {}
 
 	virtual action take_action(const board& after) {
-		std::shuffle(space.begin(), space.end(), engine);
-		for (int pos : space) {
-			if (after(pos) != 0) continue;
-			board::cell tile = popup(engine) ? 1 : 2;
-			return action::place(pos, tile);
-		}
-		return action();
+		unsigned space = 0;
+		for (unsigned pos = 0; pos < 16; pos++)
+			space |= unsigned(after(pos) == 0) << pos;
+		if (space == 0) return action();
+		unsigned draw = engine.uniform(__builtin_popcount(space) * 10);
+		board::cell tile = (draw % 10) ? 1 : 2;
+		return action::place(select(space, draw / 10), tile);
 	}
 
 private:
-	std::array<int, 16> space;
-	std::uniform_int_distribution<int> popup;
+	/**
+	 * the position of the k-th (0-based) set bit of the mask
+	 */
+	static unsigned select(unsigned mask, unsigned k) {
+#if defined(__BMI2__)
+		return __builtin_ctz(_pdep_u32(1u << k, mask));
+#else
+		while (k--) mask &= mask - 1;
+		return __builtin_ctz(mask);
+#endif
+	}
 };
 
 /**
@@ -160,7 +610,7 @@ public:
 
 	virtual action take_action(const board& before) {
 		if (play_style == 0){
-			std::shuffle(opcode.begin(), opcode.end(), engine);
+			engine.shuffle(opcode.begin(), opcode.end());
 			for (int op : opcode) {
 				board::reward reward = board(before).slide(op);
 				if (reward != -1) return action::slide(op);
@@ -214,215 +664,427 @@ private:
 
 /**
  * player for TD learning
+ *
+ * the afterstates of an episode are updated backward at the end of the episode, toward either
+ * the n-step return (n=1 by default), or the lambda-return if 'lambda' is given (e.g., lambda=0.5),
+ * which may be truncated to the first 'trace' steps (e.g., trace=5, untruncated by default)
+ *
+ * if 'online' is given, each afterstate is updated toward its n-step return during the episode,
+ * as soon as the afterstate n steps later is known, so that only the last n + 1 steps are kept
+ *
+ * if 'replay' is given, e.g., replay=1000000, the transitions of each episode are pushed into a replay
+ * buffer of that many transitions instead (see replay.h), which are sampled and applied as one-step updates
+ * by 'learners' threads (1 by default) in batches of 'replay-batch' (256 by default), at most 'replay-ratio'
+ * (1 by default) samples per pushed transition; the learners update the shared tables without locks,
+ * so that more than one learner may lose dirty pages, and 'delta' is rejected with them
  */
 class TD_player : public weight_agent {
 public:
-	TD_player(const std::string& args = "") : weight_agent("name=TD role=player " + args) {
+	TD_player(const std::string& args = "") : weight_agent("name=TD role=player " + args), slot(0) {
 		opcode = {0, 1, 2, 3};
 		n_step = 1;
+		lambda = -1;
+		trace = 0;
+		online = meta.find("online") != meta.end();
 
 		if(meta.find("n") != meta.end()) n_step = int(meta["n"]);
+		if(meta.find("lambda") != meta.end()) lambda = float(meta["lambda"]);
+		if(meta.find("trace") != meta.end()) trace = int(meta["trace"]);
+		if(n_step < 1) throw std::invalid_argument("n must be positive");
+		if(meta.find("lambda") != meta.end() && (lambda < 0 || lambda > 1)) throw std::invalid_argument("lambda must be in [0, 1]");
+		if(trace < 0) throw std::invalid_argument("trace must be non-negative");
+		if(online && lambda >= 0) throw std::invalid_argument("online updates support n-step returns only");
+		if(meta.find("replay") != meta.end() && alpha != 0) {
+			if(online || lambda >= 0 || n_step != 1 || coherence.size())
+				throw std::invalid_argument("replay supports plain one-step updates only");
+			size_t capacity = size_t(meta["replay"]), batch = 256;
+			unsigned learners = 1;
+			float ratio = 1;
+			if(meta.find("learners") != meta.end()) learners = unsigned(meta["learners"]);
+			if(meta.find("replay-batch") != meta.end()) batch = size_t(meta["replay-batch"]);
+			if(meta.find("replay-ratio") != meta.end()) ratio = float(meta["replay-ratio"]);
+			if(learners > 1 && meta.find("delta") != meta.end())
+				throw std::invalid_argument("delta snapshots support one learner only"); // the learners mark dirty pages without locks
+			buffer.reset(new replay(capacity, learners, batch, ratio, alpha,
+				[this](std::vector<replay::transition>& batch, float alpha) { learn(batch, alpha); }));
+		}
 
-		std::cout << "n_step: " << n_step << "\n";
-	}
-
-	int extract_feature(const board &after, int a, int b, int c, int d, int e){
-		return after(a) * 31 * 31 * 31 * 31 + after(b) * 31 * 31 * 31 + after(c) * 31 * 31 + after(d) * 31 + after(e);
-	}
-
-	int extract_feature2(const board &after, int a, int b, int c, int d){
-		return after(a) * 31 * 31 * 31 + after(b) * 31 * 31 + after(c) * 31 + after(d);
+		if(lambda < 0) std::cout << "n_step: " << n_step << (online ? ", online" : "") << "\n";
+		else std::cout << "lambda: " << lambda << (trace ? ", trace: " + std::to_string(trace) : "") << "\n";
 	}
 
+	/**
+	 * the value of an afterstate, as used by the TD updates, which is not counted as a search estimate
+	 */
 	float estimate_value(const board &after){
 		float value = 0.0;
-		value += net[0][extract_feature(after, 0, 1, 2, 3, 4)];
-		value += net[1][extract_feature(after, 5, 6, 7, 10, 11)];
-		value += net[2][extract_feature(after, 8, 9, 12, 13, 14)];
-		value += net[3][extract_feature(after, 0, 1, 2, 3, 7)];
-		value += net[4][extract_feature(after, 4, 5, 6, 8, 9)];
-		value += net[5][extract_feature(after, 10, 11, 13, 14, 15)];
-		value += net[6][extract_feature(after, 1, 2, 3, 6, 7)];
-		value += net[7][extract_feature(after, 4, 5, 8, 9, 10)];
-		value += net[8][extract_feature(after, 11, 12, 13, 14, 15)];
-		value += net[9][extract_feature(after, 0, 1, 2, 4, 5)];
-		value += net[10][extract_feature(after, 6, 7, 9, 10, 11)];
-		value += net[11][extract_feature(after, 8, 12, 13, 14, 15)];
-		value += net[12][extract_feature(after, 0, 4, 8, 12, 13)];
-		value += net[13][extract_feature(after, 1, 2, 5, 6, 9)];
-		value += net[14][extract_feature(after, 7, 10, 11, 14, 15)];
-		value += net[15][extract_feature(after, 0, 1, 4, 8, 12)];
-		value += net[16][extract_feature(after, 5, 9, 10, 13, 14)];
-		value += net[17][extract_feature(after, 2, 3, 6, 7, 11)];
-		value += net[18][extract_feature(after, 2, 3, 7, 11, 15)];
-		value += net[19][extract_feature(after, 6, 9, 10, 13, 14)];
-		value += net[20][extract_feature(after, 0, 1, 4, 5, 8)];
-		value += net[21][extract_feature(after, 3, 7, 11, 14, 15)];
-		value += net[22][extract_feature(after, 1, 2, 5, 6, 10)];
-		value += net[23][extract_feature(after, 4, 8, 9, 12, 13)];
-
-		value += net[24][extract_feature2(after, 0, 1, 2, 3)];
-		value += net[25][extract_feature2(after, 4, 5, 6, 7)];
-		value += net[26][extract_feature2(after, 8, 9, 10, 11)];
-		value += net[27][extract_feature2(after, 12, 13, 14, 15)];
-		value += net[28][extract_feature2(after, 0, 4, 8, 12)];
-		value += net[29][extract_feature2(after, 1, 5, 9, 13)];
-		value += net[30][extract_feature2(after, 2, 6, 10, 14)];
-		value += net[31][extract_feature2(after, 3, 7, 11, 15)];
+		for (size_t t = stage(after), end = t + net.size() / stages(); t < end; t++) value += net[t][net[t].indexof(after)];
 		return value;
 	}
 
+	/**
+	 * estimate the values of n afterstates at once, where the entries of afterstate i + ahead
+	 * are prefetched before summing those of afterstate i, so that the cache misses overlap
+	 */
+	void estimate_values(const board* after, float* value, size_t n) {
+		COUNT(estimates, n);
+		const std::vector<weight>& net = this->net;
+		const size_t ahead = 2, m = net.size() / stages();
+		size_t first[ahead] = {}; // the first table of the stage of each afterstate in flight
+		indices.resize(ahead * m);
+		for (size_t i = 0; i < n + ahead; i++) {
+			size_t* index = &indices[(i % ahead) * m];
+			if (i >= ahead) {
+				const weight* w = &net[first[i % ahead]];
+				float sum = 0.0;
+				for (size_t t = 0; t < m; t++) sum += w[t][index[t]];
+				value[i - ahead] = sum;
+			}
+			if (i < n) {
+				const weight* w = &net[first[i % ahead] = stage(after[i])];
+				for (size_t t = 0; t < m; t++) {
+					index[t] = w[t].indexof(after[i]);
+					__builtin_prefetch(&w[t][index[t]]);
+				}
+			}
+		}
+	}
+
 	struct step{
 		board::reward reward;
 		board after;
 	};
 
-	std::vector<step> history;
+	/**
+	 * the steps of an episode, where only the last 'window' steps are kept as a ring if window > 0
+	 */
+	struct trajectory {
+		std::vector<step> steps;
+		size_t moves;
+		size_t window;
+		float recent; // the sum of the rewards of the last n steps (online updates only)
 
-	float expect_value(const board &after){
-		std::vector<int> empty_tile;
-		int num_empty = 0;
-		for(int i = 0 ; i < 16 ; i++){
-			if(after(i) == 0){
-				num_empty++;
-				empty_tile.push_back(i);
-			} 
+		trajectory() : moves(0), window(0), recent(0) {}
+		void clear(size_t keep = 0) {
+			steps.clear();
+			moves = 0;
+			window = keep;
+			recent = 0;
 		}
+		void push_back(const step& s) {
+			if (window && steps.size() == window) steps[moves % window] = s;
+			else steps.push_back(s);
+			moves++;
+		}
+		size_t size() const { return moves; }
+		const step& operator [](size_t i) const { return steps[window ? i % window : i]; }
+		const step& back() const { return (*this)[moves - 1]; }
+	};
 
-		float value = 0.0;
-		for(int i : empty_tile){
-			board state1 = after;
-			state1.tile[i / 4][i % 4] = 1;
-			board::reward best_reward1 = -1;
-			float best_value1 = -std::numeric_limits<float>::max();
+	trajectory history;
 
-			for(int op1 : opcode){
-				board after1 = state1;
-				board::reward reward1 = after1.slide(op1);
-				if(reward1 < 0) continue;
-				
-				float value1 = estimate_value(after1);
-				if(reward1 + value1 > best_reward1 + best_value1) {
-					best_reward1 = reward1;
-					best_value1 = value1;
-				}
-			}
+	float expect_value(const board &after){
+		chances.clear();
+		leaves.clear();
+		rewards.clear();
+		expand(after);
+		values.resize(leaves.size());
+		estimate_values(leaves.data(), values.data(), leaves.size());
+		return reduce(0, chances.size());
+	}
 
-			board state2 = after;
-			state2.tile[i / 4][i % 4] = 2;
-			board::reward best_reward2 = -1;
-			float best_value2 = -std::numeric_limits<float>::max();
-
-			for(int op2 : opcode){
-				board after2 = state2;
-				board::reward reward2 = after2.slide(op2);
-				if(reward2 < 0) continue;
-
-				float value2 = estimate_value(after2);
-				if(reward2 + value2 > best_reward2 + best_value2) {
-					best_reward2 = reward2;
-					best_value2 = value2;
-				}			
-			}
+	virtual action take_action(const board& before) {
+		search(&before, 1);
+		const decision& best = decisions[0];
+		if(best.op != -1)	record(history, best.reward, best.after);
+		return action::slide(best.op);
+	}
 
-			value += (float(0.9) * best_value1) / float(num_empty);
-			value += (float(0.1) * best_value2) / float(num_empty);
+	/**
+	 * take the actions of several lockstep slots at once, so that the afterstates
+	 * of all the slots are evaluated as one batch
+	 */
+	virtual void take_actions(const std::vector<size_t>& slots, const std::vector<board>& before, std::vector<action>& moves) {
+		search(before.data(), before.size());
+		moves.resize(before.size());
+		for (size_t i = 0; i < before.size(); i++) {
+			const decision& best = decisions[i];
+			trajectory& hist = (slots[i] == slot) ? history : stash[slots[i]];
+			if (best.op != -1) record(hist, best.reward, best.after);
+			moves[i] = action::slide(best.op);
 		}
+	}
 
-		return value;
+	virtual void switch_slot(size_t s) {
+		if (std::max(s, slot) >= stash.size()) stash.resize(std::max(s, slot) + 1);
+		std::swap(history, stash[slot]);
+		std::swap(history, stash[s]);
+		slot = s;
 	}
 
-	virtual action take_action(const board& before) {
-		int best_op = -1;
-		board::reward best_reward = -1;
-		float best_value = -std::numeric_limits<float>::max();
-		board best_after;
+protected:
+	/**
+	 * append the selected afterstate and its reward, and update the afterstate n steps earlier
+	 * toward its n-step return if online, i.e., the rewards of the last n steps plus the new value
+	 */
+	void record(trajectory& hist, board::reward reward, const board& after) {
+		if (online && hist.size() >= size_t(n_step)) hist.recent -= hist[hist.size() - n_step].reward;
+		hist.push_back({reward, after});
+		if (!online) return;
+		hist.recent += reward;
+		if (alpha != 0 && hist.size() > size_t(n_step))
+			adjust_value(hist[hist.size() - 1 - n_step].after, hist.recent + estimate_value(after));
+	}
 
-		for(int op : opcode){
-			board after = before;
-			board::reward reward = after.slide(op);
+	/**
+	 * the expectimax search of n boards in three passes: list the afterstates of every board and
+	 * the leaves below their chance nodes (expand), evaluate all the leaves at once (estimate_values),
+	 * then back up the values (reduce) and select the best action of each board into decisions
+	 */
+	void search(const board* before, size_t n) {
+		candidates.clear();
+		chances.clear();
+		leaves.clear();
+		rewards.clear();
+		for (size_t k = 0; k < n; k++) {
+			for (int op : opcode) {
+				board after = before[k];
+				board::reward reward = after.slide(op);
+				if (reward < 0) continue;
+				candidates.push_back({k, op, reward, after, chances.size(), 0});
+				COUNT(afterstates, 1);
+				expand(after);
+				candidates.back().last = chances.size();
+			}
+		}
+		values.resize(leaves.size());
+		estimate_values(leaves.data(), values.data(), leaves.size());
 
-			if(reward < 0) continue;
+		decisions.assign(n, { -1, -1, -std::numeric_limits<float>::max(), board() });
+		for (const candidate& cand : candidates) {
+			decision& best = decisions[cand.root];
+			float value = reduce(cand.first, cand.last);
+			if (cand.reward + value > best.reward + best.value) {
+				best = { cand.op, cand.reward, value, cand.after };
+			}
+		}
+	}
 
-			float value = expect_value(after);
+	/**
+	 * append the chance nodes below an afterstate, i.e., a 2-tile (90%) and a 4-tile (10%)
+	 * for each empty cell, and the legal afterstates of each chance node as leaves
+	 */
+	void expand(const board& after) {
+		unsigned empty = 0;
+		for (int i = 0; i < 16; i++) empty += (after(i) == 0);
+		for (int i = 0; i < 16; i++) {
+			if (after(i) != 0) continue;
+			for (board::cell tile = 1; tile <= 2; tile++) {
+				board state = after;
+				state(i) = tile;
+				chances.push_back({ (tile == 1) ? float(0.9) : float(0.1), empty, leaves.size() });
+				COUNT(chance_nodes, 1);
+				for (int op : opcode) {
+					board next = state;
+					board::reward reward = next.slide(op);
+					if (reward < 0) continue;
+					leaves.push_back(next);
+					rewards.push_back(reward);
+				}
+			}
+		}
+	}
 
-			if(reward + value > best_reward + best_value){
-				best_op = op;
-				best_reward = reward;
-				best_value = value;
-				best_after = after;
+	/**
+	 * the expected value of chance nodes [first, last), where each chance node takes the value
+	 * of its best leaf (by reward plus value), or the lowest value if it has no legal leaf
+	 */
+	float reduce(size_t first, size_t last) const {
+		float value = 0.0;
+		for (size_t c = first; c < last; c++) {
+			size_t end = (c + 1 < chances.size()) ? chances[c + 1].leaf : leaves.size();
+			board::reward best_reward = -1;
+			float best_value = -std::numeric_limits<float>::max();
+			for (size_t l = chances[c].leaf; l < end; l++) {
+				if (rewards[l] + values[l] > best_reward + best_value) {
+					best_reward = rewards[l];
+					best_value = values[l];
+				}
 			}
+			value += (chances[c].prob * best_value) / float(chances[c].empty);
 		}
+		return value;
+	}
 
-		if(best_op != -1)	history.push_back({best_reward, best_after});
+	struct candidate {
+		size_t root;
+		int op;
+		board::reward reward;
+		board after;
+		size_t first, last; // chance nodes
+	};
+	struct chance {
+		float prob;
+		unsigned empty;
+		size_t leaf; // the first leaf
+	};
+	struct decision {
+		int op;
+		board::reward reward;
+		float value;
+		board after;
+	};
+	std::vector<candidate> candidates;
+	std::vector<chance> chances;
+	std::vector<board> leaves;
+	std::vector<board::reward> rewards;
+	std::vector<float> values;
+	std::vector<size_t> indices;
+	std::vector<decision> decisions;
 
-		return action::slide(best_op);
-	}
+	std::vector<trajectory> stash;
+	size_t slot;
 
-	void adjust_value(const board &after, int target){
+public:
+	/**
+	 * update the afterstate toward the target, and return its value after the update
+	 */
+	float adjust_value(const board &after, float target){
+		COUNT(updates, 1);
 		float cur = estimate_value(after);
 		float err = target - cur;
 		float adjust = alpha * err;
-		net[0][extract_feature(after, 0, 1, 2, 3, 4)] += adjust;
-		net[1][extract_feature(after, 5, 6, 7, 10, 11)] += adjust;
-		net[2][extract_feature(after, 8, 9, 12, 13, 14)] += adjust;
-		net[3][extract_feature(after, 0, 1, 2, 3, 7)] += adjust;
-		net[4][extract_feature(after, 4, 5, 6, 8, 9)] += adjust;
-		net[5][extract_feature(after, 10, 11, 13, 14, 15)] += adjust;
-		net[6][extract_feature(after, 1, 2, 3, 6, 7)] += adjust;
-		net[7][extract_feature(after, 4, 5, 8, 9, 10)] += adjust;
-		net[8][extract_feature(after, 11, 12, 13, 14, 15)] += adjust;
-		net[9][extract_feature(after, 0, 1, 2, 4, 5)] += adjust;
-		net[10][extract_feature(after, 6, 7, 9, 10, 11)] += adjust;
-		net[11][extract_feature(after, 8, 12, 13, 14, 15)] += adjust;
-		net[12][extract_feature(after, 0, 4, 8, 12, 13)] += adjust;
-		net[13][extract_feature(after, 1, 2, 5, 6, 9)] += adjust;
-		net[14][extract_feature(after, 7, 10, 11, 14, 15)] += adjust;
-		net[15][extract_feature(after, 0, 1, 4, 8, 12)] += adjust;
-		net[16][extract_feature(after, 5, 9, 10, 13, 14)] += adjust;
-		net[17][extract_feature(after, 2, 3, 6, 7, 11)] += adjust;
-		net[18][extract_feature(after, 2, 3, 7, 11, 15)] += adjust;
-		net[19][extract_feature(after, 6, 9, 10, 13, 14)] += adjust;
-		net[20][extract_feature(after, 0, 1, 4, 5, 8)] += adjust;
-		net[21][extract_feature(after, 3, 7, 11, 14, 15)] += adjust;
-		net[22][extract_feature(after, 1, 2, 5, 6, 10)] += adjust;
-		net[23][extract_feature(after, 4, 8, 9, 12, 13)] += adjust;	
-
-		net[24][extract_feature2(after, 0, 1, 2, 3)] += adjust;	
-		net[25][extract_feature2(after, 4, 5, 6, 7)] += adjust;	
-		net[26][extract_feature2(after, 8, 9, 10, 11)] += adjust;	
-		net[27][extract_feature2(after, 12, 13, 14, 15)] += adjust;	
-		net[28][extract_feature2(after, 0, 4, 8, 12)] += adjust;	
-		net[29][extract_feature2(after, 1, 5, 9, 13)] += adjust;	
-		net[30][extract_feature2(after, 2, 6, 10, 14)] += adjust;	
-		net[31][extract_feature2(after, 3, 7, 11, 15)] += adjust;	
+		size_t first = stage(after), last = first + net.size() / stages();
+		if (coherence.size()) {
+			for (size_t t = first; t < last; t++) {
+				size_t i = net[t].indexof(after);
+				weight::type& e = coherence[t][2 * i];
+				weight::type& a = coherence[t][2 * i + 1];
+				float delta = (a != 0) ? adjust * std::fabs(e) / a : adjust;
+				net[t].update(i, delta);
+				cur += delta;
+				e += err;
+				a += std::fabs(err);
+			}
+			return cur;
+		}
+		for (size_t t = first; t < last; t++) net[t].update(net[t].indexof(after), adjust);
+		return cur + adjust * (last - first);
+	}
+	/**
+	 * stop the learners before saving, so that no update is applied during or after the save
+	 */
+	virtual void save() {
+		buffer.reset();
+		weight_agent::save();
 	}
+
 	void open_episode(const std::string &flag = ""){
-		history.clear();
+		history.clear(online ? n_step + 1 : 0);
 	}
 
 	void close_episode(const std::string &flag = ""){
 		if(history.size() == 0) return;
 		if(alpha == 0) return;
+		if(lambda >= 0) return update_lambda();
+		if(online) return update_remaining();
+		if(buffer) return push_transitions();
 
-		adjust_value(history.back().after, 0);
-		for(int i = history.size() - 2 ; i >= 0 ; i--){
-			board::reward total_reward = 0;
-			for(int j = 1 ; j <= n_step ; j++){
-				if(i + j >= int(history.size())) break;
-				total_reward += history[i + j].reward;
-			}
+		// the rewards of steps (i, i + n] are kept as a running sum, so that the pass is O(T) for any n
+		int last = history.size() - 1;
+		float total_reward = 0;
+		adjust_value(history[last].after, 0);
+		for(int i = last - 1 ; i >= 0 ; i--){
+			total_reward += history[i + 1].reward;
+			if(i + n_step < last) total_reward -= history[i + n_step + 1].reward;
 
-			if(i + n_step >= int(history.size())){
+			if(i + n_step > last){
 				adjust_value(history[i].after, total_reward);
 				continue;
 			}
 
 			adjust_value(history[i].after, total_reward + estimate_value(history[i + n_step].after));
 		}
-	} 
+	}
+
+protected:
+	/**
+	 * update the last n afterstates left by the online updates, backward toward their returns,
+	 * which end with the episode
+	 */
+	void update_remaining() {
+		int last = history.size() - 1;
+		float total_reward = 0;
+		adjust_value(history[last].after, 0);
+		for(int i = last - 1 ; i >= 0 && i + n_step > last ; i--){
+			total_reward += history[i + 1].reward;
+			adjust_value(history[i].after, total_reward);
+		}
+	}
+
+	void push_transitions() {
+		buffer->rate(alpha); // the learners take the rate from the buffer, never from this thread
+		size_t last = history.size() - 1;
+		for(size_t i = 0 ; i < last ; i++)
+			buffer->push({ history[i].after, history[i + 1].after, float(history[i + 1].reward), false });
+		buffer->push({ history[last].after, board(), 0, true });
+	}
+
+	/**
+	 * apply a batch of transitions sampled by a learner thread, where the adjustments of all the
+	 * transitions are computed first, then sorted by table and entry, so that the writes sweep
+	 * each table in order instead of jumping between tables
+	 */
+	void learn(std::vector<replay::transition>& batch, float alpha) {
+		struct adjustment {
+			uint32_t table;
+			size_t index;
+			float delta;
+			bool operator <(const adjustment& a) const { return table != a.table ? table < a.table : index < a.index; }
+		};
+		thread_local std::vector<adjustment> adjustments;
+		adjustments.clear();
+		COUNT(updates, batch.size());
+		for (const replay::transition& t : batch) {
+			float target = t.reward + (t.last ? 0 : estimate_value(t.next));
+			float delta = alpha * (target - estimate_value(t.after));
+			for (size_t i = stage(t.after), end = i + net.size() / stages(); i < end; i++)
+				adjustments.push_back({ uint32_t(i), net[i].indexof(t.after), delta });
+		}
+		std::sort(adjustments.begin(), adjustments.end());
+		for (const adjustment& a : adjustments) net[a.table].update(a.index, a.delta);
+	}
+
+	/**
+	 * update the afterstates backward toward their lambda-returns in a single pass, where
+	 *   G(i) = r(i + 1) + (1 - lambda) V(i + 1) + lambda G(i + 1), and G(last) = 0,
+	 * and V(i) is the value of afterstate i just after its update (as for the n-step returns);
+	 * the return truncated to h = 'trace' steps replaces the tail beyond step i + h with V(i + h), i.e.,
+	 *   G(i, h) = G(i) - lambda^h (G(i + h) - V(i + h))
+	 */
+	void update_lambda() {
+		int last = history.size() - 1;
+		returns.resize(history.size());
+		backups.resize(history.size());
+		float decay = trace ? std::pow(lambda, float(trace)) : 0;
+		returns[last] = 0;
+		backups[last] = adjust_value(history[last].after, 0);
+		for(int i = last - 1 ; i >= 0 ; i--){
+			returns[i] = history[i + 1].reward + (1 - lambda) * backups[i + 1] + lambda * returns[i + 1];
+			float target = returns[i];
+			if(trace && i + trace <= last) target -= decay * (returns[i + trace] - backups[i + trace]);
+			backups[i] = adjust_value(history[i].after, target);
+		}
+	}
+
 private:
 	std::array<int, 4> opcode;
 	int play_style;
 	int n_step;
+	float lambda; // negative for the n-step returns
+	int trace;
+	bool online;
+	std::vector<float> returns; // the lambda-returns of the episode
+	std::vector<float> backups; // the values of the afterstates of the episode after their updates
+	std::unique_ptr<replay> buffer; // destroyed first, so that the learners stop before the weights are saved
 };
\ No newline at end of file
@@ -0,0 +1,166 @@
+/**
+ * Framework for 2048 & 2048-like Games (C++ 11)
+ * archive.h: Binary container of episode records
+ *
+ * Author: Theory of Computer Games (TCG 2021)
+ *         Computer Games and Intelligence (CGI) Lab, NYCU, Taiwan
+ *         https://cgilab.nctu.edu.tw/
+ */
+
+#pragma once
+#include <fstream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstring>
+#include <cstdint>
+#include <stdexcept>
+#include "episode.h"
+
+/**
+ * the binary episode container, which is laid out as
+ *   header: "NTEPISOD", version (uint32), columns (uint32, see episode::column)
+ *   records: length (uint32) followed by the record (see episode::encode), for each episode
+ *   index: offset of each record (uint64), count (uint64), "NTEPIDX1"
+ * where fixed-size integers are little-endian
+ *
+ * the index is written when the archive is closed; an archive without the index,
+ * e.g., left by a crash, is still readable by scanning the records
+ */
+class archive {
+public:
+	static constexpr uint32_t version = 1;
+
+	/**
+	 * whether the file at the path begins with the archive magic
+	 */
+	static bool detect(const std::string& path) {
+		char head[8] = {};
+		std::ifstream in(path, std::ios::in | std::ios::binary);
+		return in.read(head, 8) && std::memcmp(head, magic(), 8) == 0;
+	}
+	/**
+	 * whether episodes saved to the path should be archived, i.e., the path ends with ".bin"
+	 */
+	static bool named(const std::string& path) {
+		return path.size() >= 4 && path.compare(path.size() - 4, 4, ".bin") == 0;
+	}
+
+	class writer {
+	public:
+		writer(const std::string& path, unsigned columns) : out(path, std::ios::out | std::ios::binary | std::ios::trunc), columns(columns) {
+			if (!out.is_open()) throw std::runtime_error("cannot open " + path + " for writing");
+			out.write(magic(), 8);
+			put(out, version, 4);
+			put(out, columns, 4);
+			offset = 16;
+		}
+		writer(const writer&) = delete;
+		writer& operator =(const writer&) = delete;
+		~writer() {
+			for (uint64_t off : index) put(out, off, 8);
+			put(out, index.size(), 8);
+			out.write(footer(), 8);
+		}
+
+		/**
+		 * append an episode, which is flushed immediately
+		 */
+		bool write(const episode& ep) {
+			buf.clear();
+			ep.encode(buf, columns);
+			put(out, buf.size(), 4);
+			out.write(buf.data(), buf.size());
+			out.flush();
+			index.push_back(offset);
+			offset += 4 + buf.size();
+			return bool(out);
+		}
+
+	private:
+		std::ofstream out;
+		unsigned columns;
+		uint64_t offset;
+		std::vector<uint64_t> index;
+		std::string buf;
+	};
+
+	/**
+	 * random access to the episodes of an archive; use one reader per thread
+	 */
+	class reader {
+	public:
+		reader(const std::string& path) : in(path, std::ios::in | std::ios::binary), path(path), index(new std::vector<uint64_t>()) {
+			char head[16];
+			if (!in.read(head, 16) || std::memcmp(head, magic(), 8) != 0)
+				throw std::runtime_error(path + " is not an episode archive");
+			if (get(head + 8, 4) != version)
+				throw std::runtime_error(path + " has unsupported version " + std::to_string(get(head + 8, 4)));
+			columns = get(head + 12, 4);
+
+			uint64_t size = in.seekg(0, std::ios::end).tellg();
+			char tail[16];
+			if (size >= 32 && in.seekg(size - 16).read(tail, 16) && std::memcmp(tail + 8, footer(), 8) == 0) {
+				uint64_t count = get(tail, 8);
+				if (count > (size - 32) / 8) throw std::runtime_error(path + " has a corrupted index");
+				std::string raw(count * 8, '\0');
+				in.seekg(size - 16 - raw.size()).read(&raw[0], raw.size());
+				for (size_t i = 0; i < count; i++) index->push_back(get(&raw[i * 8], 8));
+			} else {
+				// no index, scan the records up to the last complete one
+				char len[4];
+				for (uint64_t off = 16; off + 4 <= size; ) {
+					in.seekg(off).read(len, 4);
+					uint64_t next = off + 4 + get(len, 4);
+					if (next > size) break;
+					index->push_back(off);
+					off = next;
+				}
+			}
+			in.clear();
+		}
+		/**
+		 * open the archive again with its own stream, sharing the offsets of the records,
+		 * so that each thread reads its own range without indexing (or scanning) the archive again
+		 */
+		reader(const reader& r) : in(r.path, std::ios::in | std::ios::binary), path(r.path), columns(r.columns), index(r.index) {
+			if (!in.is_open()) throw std::runtime_error("cannot open " + path);
+		}
+		reader& operator =(const reader&) = delete;
+
+		size_t size() const { return index->size(); }
+
+		/**
+		 * read the i-th episode
+		 */
+		void read(size_t i, episode& ep) {
+			char len[4];
+			if (!in.seekg(index->at(i)).read(len, 4)) throw std::runtime_error("truncated episode archive");
+			buf.resize(get(len, 4));
+			if (!in.read(&buf[0], buf.size())) throw std::runtime_error("truncated episode archive");
+			ep.decode(buf.data(), buf.data() + buf.size(), columns);
+		}
+
+	private:
+		std::ifstream in;
+		std::string path;
+		unsigned columns;
+		std::shared_ptr<std::vector<uint64_t>> index; // the offsets of the records, shared by the copies
+		std::string buf;
+	};
+
+private:
+	static const char* magic() { return "NTEPISOD"; }
+	static const char* footer() { return "NTEPIDX1"; }
+
+	static void put(std::ostream& out, uint64_t v, size_t n) {
+		char b[8];
+		for (size_t i = 0; i < n; i++) b[i] = char(v >> (i * 8));
+		out.write(b, n);
+	}
+	static uint64_t get(const char* b, size_t n) {
+		uint64_t v = 0;
+		for (size_t i = 0; i < n; i++) v |= uint64_t((unsigned char)(b[i])) << (i * 8);
+		return v;
+	}
+};
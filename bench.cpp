@@ -0,0 +1,310 @@
+/**
+ * Framework for 2048 & 2048-like Games (C++ 11)
+ * bench.cpp: Micro-benchmarks of the board, the evaluator, and the agents
+ *
+ * Author: Theory of Computer Games (TCG 2021)
+ *         Computer Games and Intelligence (CGI) Lab, NYCU, Taiwan
+ *         https://cgilab.nctu.edu.tw/
+ */
+
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <algorithm>
+#include <sstream>
+#include <map>
+#include "board.h"
+#include "action.h"
+#include "agent.h"
+#include "episode.h"
+
+/**
+ * the timings of a benchmark, i.e., 'repeat' runs of 'ops' operations each
+ */
+struct result {
+	std::string name;
+	size_t ops;
+	std::vector<double> ns; // nanoseconds per operation of each run
+
+	double mean() const {
+		double sum = 0;
+		for (double v : ns) sum += v;
+		return sum / ns.size();
+	}
+	double stdev() const {
+		double avg = mean(), sum = 0;
+		for (double v : ns) sum += (v - avg) * (v - avg);
+		return ns.size() > 1 ? std::sqrt(sum / (ns.size() - 1)) : 0;
+	}
+};
+
+volatile long sink; // keeps the results of the benchmarks alive
+
+/**
+ * time 'run', which performs 'ops' operations, once for warming up and then 'repeat' times
+ */
+result measure(const std::string& name, size_t ops, size_t repeat, const std::function<void()>& run) {
+	result res = { name, ops, {} };
+	run();
+	for (size_t r = 0; r < repeat; r++) {
+		auto start = std::chrono::steady_clock::now();
+		run();
+		auto stop = std::chrono::steady_clock::now();
+		res.ns.push_back(std::chrono::duration<double, std::nano>(stop - start).count() / ops);
+	}
+	return res;
+}
+
+/**
+ * the TD player of the benchmarks, whose tables can be filled with pseudo-random weights,
+ * so that the lookups touch the tables as a trained network does, instead of the shared zero pages
+ */
+class bench_player : public TD_player {
+public:
+	bench_player(const std::string& args) : TD_player(args) {}
+
+	/**
+	 * set the entries to pseudo-random weights in [-1, 1) from the seed, where only one run of
+	 * 'run' entries (a 4 KiB page) out of every 'stride' runs is filled to save memory
+	 */
+	void fill(uint64_t seed, size_t stride = 1) {
+		if (net.empty()) throw std::runtime_error("fill: the network is not initialized");
+		const size_t run = 4096 / sizeof(weight::type);
+		rng engine("xoshiro", seed);
+		for (weight& w : net)
+			for (size_t i = 0; i < w.size(); i += run * stride)
+				for (size_t k = i; k < std::min(i + run, w.size()); k++) w[k] = float(engine() >> 40) * (2.0f / (1 << 24)) - 1.0f;
+	}
+};
+
+/**
+ * play episodes between a player and the environment, and return the number of moves
+ */
+size_t play(agent& play, agent& evil, size_t games) {
+	size_t moves = 0;
+	episode game;
+	for (size_t i = 0; i < games; i++) {
+		play.open_episode("~:" + evil.name());
+		evil.open_episode(play.name() + ":~");
+		game.clear();
+		game.open_episode(play.name() + ":" + evil.name());
+		while (true) {
+			agent& who = game.take_turns(play, evil);
+			action move = who.take_action(game.state());
+			if (game.apply_action(move) != true) break;
+			if (who.check_for_win(game.state())) break;
+		}
+		agent& win = game.last_turns(play, evil);
+		game.close_episode(win.name());
+		play.close_episode(win.name());
+		evil.close_episode(win.name());
+		moves += game.step();
+	}
+	return moves;
+}
+
+/**
+ * print the results of several tags (e.g., build variants) saved as JSON lines side by side,
+ * with the speedup of each tag relative to the first one
+ */
+void compare(const std::string& path) {
+	std::ifstream in(path, std::ios::in);
+	if (!in.is_open()) throw std::runtime_error("cannot open " + path);
+	auto field = [](const std::string& line, const std::string& key) {
+		size_t pos = line.find("\"" + key + "\":");
+		if (pos == std::string::npos) return std::string();
+		pos += key.size() + 3;
+		if (line[pos] == '"') return line.substr(pos + 1, line.find('"', pos + 1) - pos - 1);
+		return line.substr(pos, line.find_first_of(",}", pos) - pos);
+	};
+	std::vector<std::string> tags, names;
+	std::map<std::pair<std::string, std::string>, double> ns; // the latest result of each (tag, name)
+	for (std::string line; std::getline(in, line); ) {
+		std::string tag = field(line, "tag"), name = field(line, "name"), value = field(line, "ns_per_op");
+		if (name.empty() || value.empty()) continue;
+		if (std::find(tags.begin(), tags.end(), tag) == tags.end()) tags.push_back(tag);
+		if (std::find(names.begin(), names.end(), name) == names.end()) names.push_back(name);
+		ns[{ tag, name }] = std::stod(value);
+	}
+
+	std::cout << std::left << std::setw(20) << "ns/op" << std::right;
+	for (const std::string& tag : tags) std::cout << std::setw(20) << tag;
+	std::cout << std::endl << std::fixed;
+	for (const std::string& name : names) {
+		std::cout << std::left << std::setw(20) << name << std::right;
+		for (const std::string& tag : tags) {
+			std::stringstream cell;
+			auto it = ns.find({ tag, name }), base = ns.find({ tags[0], name });
+			if (it != ns.end()) {
+				cell << std::fixed << std::setprecision(2) << it->second;
+				if (tag != tags[0] && base != ns.end()) cell << " (" << std::setprecision(2) << (base->second / it->second) << "x)";
+			}
+			std::cout << std::setw(20) << cell.str();
+		}
+		std::cout << std::endl;
+	}
+}
+
+int main(int argc, const char* argv[]) try {
+	size_t repeat = 10, size = 4096, games = 20, stride = 1;
+	std::string td_args, fill, format, out, tag;
+	for (int i = 1; i < argc; i++) {
+		std::string para(argv[i]);
+		if (para.find("--repeat=") == 0) {
+			repeat = std::stoull(para.substr(para.find("=") + 1));
+		} else if (para.find("--boards=") == 0) {
+			size = std::stoull(para.substr(para.find("=") + 1));
+		} else if (para.find("--games=") == 0) {
+			games = std::stoull(para.substr(para.find("=") + 1));
+		} else if (para.find("--play=") == 0) {
+			td_args = para.substr(para.find("=") + 1);
+		} else if (para.find("--fill=") == 0) {
+			fill = para.substr(para.find("=") + 1);
+		} else if (para.find("--fill-stride=") == 0) {
+			stride = std::max<size_t>(std::stoull(para.substr(para.find("=") + 1)), 1);
+		} else if (para.find("--format=") == 0) {
+			format = para.substr(para.find("=") + 1);
+		} else if (para.find("--out=") == 0) {
+			out = para.substr(para.find("=") + 1);
+		} else if (para.find("--tag=") == 0) {
+			tag = para.substr(para.find("=") + 1);
+		} else if (para.find("--compare=") == 0) {
+			compare(para.substr(para.find("=") + 1));
+			return 0;
+		}
+	}
+	episode::timing() = false;
+	if (td_args.empty()) {
+		td_args = "init alpha=0.0025";
+		if (fill.empty()) fill = "1"; // a filled network, not the zero pages
+	}
+
+	// the corpus: the states met by the dummy player, and the placements made by the environment
+	std::vector<board> before, after;
+	std::vector<std::pair<board, action>> places;
+	{
+		player dummy("seed=1");
+		rndenv evil("seed=2");
+		episode game;
+		while (before.size() < size) {
+			dummy.open_episode();
+			evil.open_episode();
+			game.clear();
+			while (true) {
+				agent& who = game.take_turns(dummy, evil);
+				action move = who.take_action(game.state());
+				if (&who == &dummy) {
+					before.push_back(game.state());
+				} else if (places.size() < size) {
+					places.emplace_back(game.state(), move);
+				}
+				if (game.apply_action(move) != true) break;
+				if (&who == &dummy) after.push_back(game.state());
+			}
+		}
+		before.resize(size);
+		after.resize(std::min(after.size(), size));
+	}
+
+	std::vector<result> results;
+	const char* dir[] = { "up", "right", "down", "left" };
+	for (unsigned op = 0; op < 4; op++) {
+		results.push_back(measure(std::string("board.slide.") + dir[op], before.size(), repeat, [&]() {
+			long sum = 0;
+			for (const board& b : before) sum += board(b).slide(op);
+			sink = sum;
+		}));
+	}
+	results.push_back(measure("board.place", places.size(), repeat, [&]() {
+		long sum = 0;
+		for (const auto& p : places) sum += board(p.first).place(action::place(p.second).position(), action::place(p.second).tile());
+		sink = sum;
+	}));
+
+	std::vector<weight> tuples; // tables of both pattern lengths, which are never touched by indexof
+	tuples.emplace_back(std::vector<unsigned>{ 0, 1, 2, 3, 4 }, 31);
+	tuples.emplace_back(std::vector<unsigned>{ 5, 6, 7, 10, 11 }, 31);
+	tuples.emplace_back(std::vector<unsigned>{ 0, 1, 2, 3 }, 31);
+	tuples.emplace_back(std::vector<unsigned>{ 0, 4, 8, 12 }, 31);
+	results.push_back(measure("weight.indexof", after.size() * tuples.size(), repeat, [&]() {
+		size_t sum = 0;
+		for (const board& b : after)
+			for (const weight& w : tuples) sum += w.indexof(b);
+		sink = sum;
+	}));
+
+	bench_player td(td_args);
+	if (fill.size()) td.fill(std::stoull(fill), stride);
+	results.push_back(measure("td.estimate_value", after.size(), repeat, [&]() {
+		float sum = 0;
+		for (const board& b : after) sum += td.estimate_value(b);
+		sink = sum;
+	}));
+	size_t expects = std::max(after.size() / 16, size_t(1));
+	results.push_back(measure("td.expect_value", expects, repeat, [&]() {
+		float sum = 0;
+		for (size_t i = 0; i < expects; i++) sum += td.expect_value(after[i]);
+		sink = sum;
+	}));
+	results.push_back(measure("td.adjust_value", after.size(), repeat, [&]() {
+		for (const board& b : after) td.adjust_value(b, 0);
+	}));
+
+	const char* styles[] = { "random", "greedy1", "greedy2" };
+	for (const char* style : styles) {
+		size_t moves = 0;
+		{
+			player dummy(std::string("seed=1 ") + style);
+			rndenv evil("seed=2");
+			moves = play(dummy, evil, games);
+		}
+		results.push_back(measure(std::string("episode.") + style, moves, repeat, [&]() {
+			player dummy(std::string("seed=1 ") + style);
+			rndenv evil("seed=2");
+			sink = play(dummy, evil, games);
+		}));
+	}
+
+	std::cout << std::endl << std::left << std::setw(20) << "benchmark" << std::right;
+	std::cout << std::setw(10) << "ops" << std::setw(14) << "ns/op" << std::setw(12) << "stdev" << std::setw(16) << "ops/s" << std::endl;
+	for (const result& res : results) {
+		std::cout << std::left << std::setw(20) << res.name << std::right << std::fixed;
+		std::cout << std::setw(10) << res.ops;
+		std::cout << std::setw(14) << std::setprecision(2) << res.mean();
+		std::cout << std::setw(12) << std::setprecision(2) << res.stdev();
+		std::cout << std::setw(16) << std::setprecision(0) << (1e9 / res.mean());
+		std::cout << std::endl;
+	}
+
+	if (out.size() || format.size()) {
+		if (format.empty()) format = (out.size() >= 4 && out.compare(out.size() - 4, 4, ".csv") == 0) ? "csv" : "json";
+		if (format != "json" && format != "csv") throw std::invalid_argument("unknown format " + format);
+		std::ofstream file;
+		if (out.size()) {
+			file.open(out, std::ios::out | std::ios::app);
+			if (!file.is_open()) throw std::runtime_error("cannot open " + out + " for writing");
+		}
+		std::ostream& o = out.size() ? file : std::cout;
+		o << std::fixed << std::setprecision(3);
+		for (const result& res : results) {
+			if (format == "csv") {
+				o << tag << ',' << res.name << ',' << res.ops << ',' << res.ns.size() << ',';
+				o << res.mean() << ',' << res.stdev() << ',' << (1e9 / res.mean()) << std::endl;
+			} else {
+				o << "{\"tag\":\"" << tag << "\",\"name\":\"" << res.name << "\",\"ops\":" << res.ops;
+				o << ",\"repeat\":" << res.ns.size() << ",\"ns_per_op\":" << res.mean();
+				o << ",\"stdev\":" << res.stdev() << ",\"ops_per_sec\":" << (1e9 / res.mean()) << "}" << std::endl;
+			}
+		}
+	}
+
+	return 0;
+} catch (std::exception& e) {
+	std::cerr << e.what() << std::endl;
+	return -1;
+}
@@ -13,6 +13,7 @@
 #include <iomanip>
 #include <algorithm>
 #include <cmath>
+#include "counter.h"
 
 /**
  * array-based board for 2048
@@ -81,13 +82,16 @@ public:
 	 * return the reward of the action, or -1 if the action is illegal
 	 */
 	reward slide(unsigned opcode) {
+		reward score = -1;
 		switch (opcode & 0b11) {
-		case 0: return slide_up();
-		case 1: return slide_right();
-		case 2: return slide_down();
-		case 3: return slide_left();
-		default: return -1;
+		case 0: score = slide_up(); break;
+		case 1: score = slide_right(); break;
+		case 2: score = slide_down(); break;
+		case 3: score = slide_left(); break;
 		}
+		COUNT(slide_tried, 1);
+		COUNT(slide_legal, score != -1);
+		return score;
 	}
 
 	reward slide_left() {
@@ -0,0 +1,67 @@
+/**
+ * Framework for 2048 & 2048-like Games (C++ 11)
+ * check.cpp: Fixed-seed checks of the random streams, which must match on every platform and library
+ *
+ * Author: Theory of Computer Games (TCG 2021)
+ *         Computer Games and Intelligence (CGI) Lab, NYCU, Taiwan
+ *         https://cgilab.nctu.edu.tw/
+ */
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <array>
+#include "rng.h"
+#include "board.h"
+#include "action.h"
+#include "agent.h"
+
+int failed = 0;
+
+void expect(const std::string& what, const std::string& got, const std::string& want) {
+	if (got == want) return;
+	std::cerr << what << ": got " << got << ", expected " << want << std::endl;
+	failed++;
+}
+
+/**
+ * the first output, 8 bounded draws in [0, 10), [0, 20), ..., [0, 80), and a shuffle of 0..7,
+ * of the stream of episode 0 with seed 1
+ */
+std::string draws(const std::string& name) {
+	rng r(name);
+	r.reseed(1, 0);
+	std::stringstream out;
+	out << std::hex << r() << std::dec;
+	for (unsigned i = 1; i <= 8; i++) out << ',' << r.uniform(10 * i);
+	std::array<int, 8> order = { 0, 1, 2, 3, 4, 5, 6, 7 };
+	r.shuffle(order.begin(), order.end());
+	out << ',';
+	for (int v : order) out << v;
+	return out.str();
+}
+
+int main() {
+	splitmix64 sm(0); // the reference outputs of SplitMix64 seeded with 0
+	std::stringstream ref;
+	ref << std::hex << sm() << ',' << sm() << ',' << sm();
+	expect("splitmix64", ref.str(), "e220a8397b1dcdaf,6e789e6aa1b965f4,6c45d188009454f");
+
+	expect("xoshiro", draws("xoshiro"), "366aa1aec12080b8,9,14,10,2,3,34,48,7,40521763");
+	expect("pcg", draws("pcg"), "c0a87138235b3b89,0,7,11,11,10,24,21,29,31765402");
+	expect("splitmix", draws("splitmix"), "85c61a300ec70fa1,2,18,5,14,12,9,15,76,25764130");
+
+	rndenv evil("seed=2"); // the first placements of the environment on an empty board
+	evil.open_episode();
+	board b;
+	std::stringstream places;
+	for (int i = 0; i < 6; i++) {
+		action move = evil.take_action(b);
+		move.apply(b);
+		places << move << ' ';
+	}
+	expect("rndenv", places.str(), "41 71 A1 E1 11 01 ");
+
+	std::cout << (failed ? "FAILED" : "OK") << std::endl;
+	return failed ? 1 : 0;
+}
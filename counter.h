@@ -0,0 +1,143 @@
+/**
+ * Framework for 2048 & 2048-like Games (C++ 11)
+ * counter.h: Optional instrumentation counters of the hot paths
+ *
+ * Author: Theory of Computer Games (TCG 2021)
+ *         Computer Games and Intelligence (CGI) Lab, NYCU, Taiwan
+ *         https://cgilab.nctu.edu.tw/
+ */
+
+#pragma once
+#include <cstdint>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+
+/**
+ * thread-local event counters, which are compiled only with -DCOUNTERS (see 'make counters'),
+ * otherwise COUNT() and TIMED() expand to nothing and cost nothing
+ *
+ * each thread counts into its own set without synchronization,
+ * and the statistic sums the sets of all threads at the end of each block
+ */
+namespace counter {
+
+enum id {
+	slide_tried,   // board::slide calls
+	slide_legal,   // board::slide calls that changed the board
+	estimates,     // leaves evaluated by the n-tuple network for the expectimax search
+	afterstates,   // afterstate (max) nodes expanded by the expectimax search
+	chance_nodes,  // chance nodes expanded by the expectimax search
+	updates,       // TD updates, i.e., adjust_value calls
+	select_ns,     // time spent by the player selecting moves
+	environment_ns,// time spent by the environment
+	update_ns,     // time spent by the player closing episodes, i.e., TD updates
+	size
+};
+
+struct set {
+	uint64_t v[size];
+	set() { for (uint64_t& x : v) x = 0; }
+	set operator -(const set& s) const {
+		set d;
+		for (int i = 0; i < size; i++) d.v[i] = v[i] - s.v[i];
+		return d;
+	}
+};
+
+/**
+ * the sets of all threads, which are never freed so that they outlive their threads
+ */
+struct registry {
+	std::mutex mutex;
+	std::vector<std::atomic<uint64_t>*> sets;
+};
+inline registry& threads() {
+	static registry all;
+	return all;
+}
+inline std::atomic<uint64_t>* local() {
+	thread_local std::atomic<uint64_t>* mine = []() {
+		std::atomic<uint64_t>* v = new std::atomic<uint64_t>[size]();
+		std::lock_guard<std::mutex> lock(threads().mutex);
+		threads().sets.push_back(v);
+		return v;
+	}();
+	return mine;
+}
+
+/**
+ * add to a counter of this thread, which is a plain load and store (no locked instruction)
+ */
+inline void add(id i, uint64_t n = 1) {
+	std::atomic<uint64_t>& v = local()[i];
+	v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+/**
+ * the sum of the counters of all threads
+ */
+inline set total() {
+	set sum;
+	std::lock_guard<std::mutex> lock(threads().mutex);
+	for (std::atomic<uint64_t>* v : threads().sets)
+		for (int i = 0; i < size; i++) sum.v[i] += v[i].load(std::memory_order_relaxed);
+	return sum;
+}
+
+inline uint64_t nanosec() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * add the time spent in a scope to a counter
+ */
+class scope {
+public:
+	scope(id i) : i(i), start(nanosec()) {}
+	~scope() { add(i, nanosec() - start); }
+private:
+	id i;
+	uint64_t start;
+};
+
+/**
+ * print the counters of a block, where 'moves' and 'games' are the player moves and the episodes
+ * of the block, and 'wall' is the wall time of the block in nanoseconds, e.g.,
+ *        slides = 5721603 (61.2% legal), estimates = 41.8/move, nodes = 2.9|20.5/move, updates = 1532.4/game
+ *        time = 81.2% select, 3.1% environment, 9.8% update, 5.9% other
+ */
+inline void report(const set& d, size_t moves, size_t games, uint64_t wall) {
+	const uint64_t* v = d.v;
+	std::ios ff(nullptr);
+	ff.copyfmt(std::cout);
+	std::cout << std::fixed << std::setprecision(1);
+	std::cout << "\t" "slides = " << v[slide_tried];
+	std::cout << " (" << (v[slide_legal] * 100.0 / std::max<uint64_t>(v[slide_tried], 1)) << "% legal), ";
+	std::cout << "estimates = " << (v[estimates] * 1.0 / std::max<size_t>(moves, 1)) << "/move, ";
+	std::cout << "nodes = " << (v[afterstates] * 1.0 / std::max<size_t>(moves, 1));
+	std::cout << "|" << (v[chance_nodes] * 1.0 / std::max<size_t>(moves, 1)) << "/move, ";
+	std::cout << "updates = " << (v[updates] * 1.0 / std::max<size_t>(games, 1)) << "/game";
+	std::cout << std::endl;
+	double all = std::max<uint64_t>(wall, 1) / 100.0;
+	uint64_t spent = v[select_ns] + v[environment_ns] + v[update_ns];
+	std::cout << "\t" "time = " << (v[select_ns] / all) << "% select, ";
+	std::cout << (v[environment_ns] / all) << "% environment, ";
+	std::cout << (v[update_ns] / all) << "% update, ";
+	std::cout << ((wall > spent ? wall - spent : 0) / all) << "% other";
+	std::cout << std::endl;
+	std::cout.copyfmt(ff);
+}
+
+} // namespace counter
+
+#if defined(COUNTERS)
+#define COUNT(i, n) counter::add(counter::i, n)
+#define TIMED(i) counter::scope timed_scope(i)
+#else
+#define COUNT(i, n) ((void)0)
+#define TIMED(i) ((void)0)
+#endif
@@ -15,6 +15,8 @@
 #include <sstream>
 #include <chrono>
 #include <numeric>
+#include <string>
+#include <stdexcept>
 #include "board.h"
 #include "action.h"
 #include "agent.h"
@@ -24,7 +26,7 @@ class statistic;
 class episode {
 friend class statistic;
 public:
-	episode() : ep_state(initial_state()), ep_score(0), ep_time(0) { ep_moves.reserve(10000); }
+	episode() : ep_state(initial_state()), ep_score(0), ep_time(0), ep_span(0), ep_slide(0), ep_place(0) {}
 
 public:
 	board& state() { return ep_state; }
@@ -32,25 +34,48 @@ public:
 	board::reward score() const { return ep_score; }
 
 	void open_episode(const std::string& tag) {
-		ep_open = { tag, millisec() };
+		ep_open = { tag, timing() ? millisec() : 0 };
+		ep_span = timing() ? nanosec() : 0;
 	}
 	void close_episode(const std::string& tag) {
-		ep_close = { tag, millisec() };
+		ep_close = { tag, timing() ? millisec() : 0 };
+		ep_span = timing() ? nanosec() - ep_span : 0;
 	}
 	bool apply_action(action move) {
 		board::reward reward = move.apply(state());
 		if (reward == -1) return false;
-		ep_moves.emplace_back(move, reward, millisec() - ep_time);
+		ep_moves.push_back(pack(move));
 		ep_score += reward;
+		if (timing()) spent(move.type()) += nanosec() - ep_time;
 		return true;
 	}
 	agent& take_turns(agent& play, agent& evil) {
-		ep_time = millisec();
+		if (timing()) ep_time = nanosec();
 		return (std::max(step() + 1, size_t(2)) % 2) ? play : evil;
 	}
 	agent& last_turns(agent& play, agent& evil) {
 		return take_turns(evil, play);
 	}
+	/**
+	 * start the time of the current move 'spent' nanoseconds ago, e.g., to charge the move
+	 * with its share of the actions taken at once for several episodes (see lockstep in 2048.cpp)
+	 */
+	void charge_turn(time_t spent) {
+		if (timing()) ep_time = nanosec() - spent;
+	}
+
+	/**
+	 * reset to a new episode while keeping the allocated storage
+	 */
+	void clear() {
+		ep_state = initial_state();
+		ep_score = 0;
+		ep_moves.clear();
+		ep_time = 0;
+		ep_span = ep_slide = ep_place = 0;
+		ep_open = {};
+		ep_close = {};
+	}
 
 public:
 	size_t step(unsigned who = -1u) const {
@@ -62,64 +87,187 @@ public:
 		}
 	}
 
+	/**
+	 * time spent in nanoseconds, which is 0 if timing is switched off
+	 */
 	time_t time(unsigned who = -1u) const {
-		time_t time = 0;
-		size_t i = 2;
 		switch (who) {
-		case action::place::type:
-			if (ep_moves.size()) time += ep_moves[0].time, i = 1;
-			// no break;
-		case action::slide::type:
-			while (i < ep_moves.size()) time += ep_moves[i].time, i += 2;
-			break;
-		default:
-			time = ep_close.when - ep_open.when;
-			break;
+		case action::slide::type: return ep_slide;
+		case action::place::type: return ep_place;
+		default:                  return ep_span;
 		}
-		return time;
+	}
+
+	/**
+	 * whether to measure the time of moves and episodes, which is enabled by default
+	 */
+	static bool& timing() {
+		static bool enabled = true;
+		return enabled;
+	}
+	/**
+	 * the time in nanoseconds of a monotonic clock, which is 0 if timing is switched off
+	 */
+	static time_t clock() {
+		return timing() ? nanosec() : 0;
+	}
+
+	/**
+	 * the aggregates of an episode needed by the statistic, which are much smaller than the episode
+	 */
+	struct digest {
+		board::reward score;
+		unsigned tile; // the largest tile (index value)
+		size_t steps[3]; // total, slide, place
+		time_t times[3]; // total, slide, place
+	};
+	digest summarize() const {
+		digest d;
+		d.score = ep_score;
+		d.tile = *std::max_element(&(ep_state(0)), &(ep_state(16)));
+		d.steps[0] = step();
+		d.steps[1] = step(action::slide::type);
+		d.steps[2] = step(action::place::type);
+		d.times[0] = time();
+		d.times[1] = time(action::slide::type);
+		d.times[2] = time(action::place::type);
+		return d;
 	}
 
 	std::vector<action> actions(unsigned who = -1u) const {
 		std::vector<action> res;
-		size_t i = 2;
-		switch (who) {
-		case action::place::type:
-			if (ep_moves.size()) res.push_back(ep_moves[0]), i = 1;
-			// no break;
-		case action::slide::type:
-			while (i < ep_moves.size()) res.push_back(ep_moves[i]), i += 2;
-			break;
-		default:
-			res.assign(ep_moves.begin(), ep_moves.end());
-			break;
+		for (uint16_t code : ep_moves) {
+			action a = unpack(code);
+			if (who == -1u || a.type() == who) res.push_back(a);
 		}
 		return res;
 	}
 
 public:
 
+	/**
+	 * the rewards are not stored, but recomputed by replaying the moves
+	 *
+	 * instead of the time of each move, the time totals (in nanoseconds) are appended
+	 * to the closing tag, e.g., "xxx@1234567890(span,slide,place)"
+	 */
 	friend std::ostream& operator <<(std::ostream& out, const episode& ep) {
 		out << ep.ep_open << '|';
-		for (const move& mv : ep.ep_moves) out << mv;
+		board state = initial_state();
+		for (uint16_t code : ep.ep_moves) {
+			action a = unpack(code);
+			board::reward reward = a.apply(state);
+			out << move(a, std::max(reward, 0));
+		}
 		out << '|' << ep.ep_close;
+		if (ep.ep_span) out << '(' << std::dec << ep.ep_span << ',' << ep.ep_slide << ',' << ep.ep_place << ')';
 		return out;
 	}
 	friend std::istream& operator >>(std::istream& in, episode& ep) {
-		ep = {};
+		ep.clear();
 		std::string token;
 		std::getline(in, token, '|');
 		std::stringstream(token) >> ep.ep_open;
 		std::getline(in, token, '|');
 		for (std::stringstream moves(token); !moves.eof(); moves.peek()) {
-			ep.ep_moves.emplace_back();
-			moves >> ep.ep_moves.back();
-			ep.ep_score += action(ep.ep_moves.back()).apply(ep.ep_state);
+			move mv;
+			moves >> mv;
+			ep.ep_moves.push_back(pack(mv.code));
+			ep.ep_score += mv.code.apply(ep.ep_state);
+			ep.spent(mv.code.type()) += mv.time * 1000000; // per-move times of old files are in milliseconds
 		}
 		std::getline(in, token, '|');
-		std::stringstream(token) >> ep.ep_close;
+		std::stringstream close(token);
+		close >> ep.ep_close;
+		ep.ep_span = (ep.ep_close.when - ep.ep_open.when) * 1000000;
+		if (close.peek() == '(') {
+			char sep;
+			close >> sep >> ep.ep_span >> sep >> ep.ep_slide >> sep >> ep.ep_place;
+		}
 		return in;
 	}
 
+	/**
+	 * the optional columns of binary records
+	 */
+	enum column : unsigned {
+		rewards = 1u << 0, // the reward of each move, which the reader checks against the replayed moves
+		times   = 1u << 1, // the time totals
+	};
+
+	/**
+	 * append the binary record of this episode to 'buf', which consists of
+	 *   the opening tag and time, the closing tag and time, the number of moves,
+	 *   the moves, and then the optional columns
+	 * where a move takes one byte, i.e., 0xf0 | opcode for a slide, (tile << 4) | position for a place,
+	 * or 0xff followed by its 16-bit code (see pack()) for others,
+	 * and integers are varints and strings are varint lengths followed by bytes
+	 */
+	void encode(std::string& buf, unsigned columns) const {
+		put_string(buf, ep_open.tag);
+		put_varint(buf, ep_open.when);
+		put_string(buf, ep_close.tag);
+		put_varint(buf, ep_close.when);
+		put_varint(buf, ep_moves.size());
+		for (uint16_t code : ep_moves) {
+			if (code & 0x400) {
+				buf.push_back(char(0xf0 | (code & 0b11)));
+			} else if (code < 0xf0) {
+				buf.push_back(char(code));
+			} else {
+				buf.push_back(char(0xff));
+				buf.push_back(char(code & 0xff));
+				buf.push_back(char(code >> 8));
+			}
+		}
+		if (columns & rewards) {
+			board state = initial_state();
+			for (uint16_t code : ep_moves) put_varint(buf, std::max(unpack(code).apply(state), 0));
+		}
+		if (columns & times) {
+			put_varint(buf, ep_span);
+			put_varint(buf, ep_slide);
+			put_varint(buf, ep_place);
+		}
+	}
+	/**
+	 * restore an episode from the binary record in [p, end), see encode()
+	 */
+	void decode(const char* p, const char* end, unsigned columns) {
+		clear();
+		ep_open.tag = get_string(p, end);
+		ep_open.when = get_varint(p, end);
+		ep_close.tag = get_string(p, end);
+		ep_close.when = get_varint(p, end);
+		size_t size = get_varint(p, end);
+		ep_moves.reserve(size);
+		for (size_t i = 0; i < size; i++) {
+			if (p == end) throw std::runtime_error("truncated episode record");
+			unsigned char c = *p++;
+			uint16_t code = c >= 0xf0 ? 0x400 | (c & 0b11) : c;
+			if (c == 0xff) {
+				if (end - p < 2) throw std::runtime_error("truncated episode record");
+				code = (unsigned char)(p[0]) | (unsigned char)(p[1]) << 8;
+				p += 2;
+			}
+			ep_moves.push_back(code);
+		}
+		// replay the moves for the score, and check the replayed rewards against the stored ones if any
+		for (uint16_t code : ep_moves) {
+			board::reward reward = unpack(code).apply(ep_state);
+			if ((columns & rewards) && get_varint(p, end) != uint64_t(std::max(reward, 0)))
+				throw std::runtime_error("episode record does not replay to its rewards");
+			if (reward > 0) ep_score += reward;
+		}
+		if (columns & times) {
+			ep_span = get_varint(p, end);
+			ep_slide = get_varint(p, end);
+			ep_place = get_varint(p, end);
+		} else {
+			ep_span = (ep_close.when - ep_open.when) * 1000000;
+		}
+	}
+
 protected:
 
 	struct move {
@@ -169,16 +317,67 @@ protected:
 	static board initial_state() {
 		return {};
 	}
+
+	/**
+	 * a move is packed into 16 bits, i.e., 0x400 | opcode for a slide,
+	 * (tile << 4) | position for a place, or 0xffff for an unknown action
+	 */
+	static uint16_t pack(const action& a) {
+		switch (a.type()) {
+		case action::slide::type: return 0x400 | (a.event() & 0b11);
+		case action::place::type: return a.event() & 0x3ff;
+		default:                  return 0xffff;
+		}
+	}
+	static action unpack(uint16_t code) {
+		if (code == 0xffff) return action();
+		if (code & 0x400) return action::slide(code & 0b11);
+		return action::place(code & 0x0f, code >> 4);
+	}
+
 	static time_t millisec() {
 		auto now = std::chrono::system_clock::now().time_since_epoch();
 		return std::chrono::duration_cast<std::chrono::milliseconds>(now).count();
 	}
+	static time_t nanosec() {
+		auto now = std::chrono::steady_clock::now().time_since_epoch();
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+	}
+	static void put_varint(std::string& buf, uint64_t v) {
+		for (; v >= 0x80; v >>= 7) buf.push_back(char((v & 0x7f) | 0x80));
+		buf.push_back(char(v));
+	}
+	static uint64_t get_varint(const char*& p, const char* end) {
+		uint64_t v = 0;
+		for (unsigned shift = 0; p != end && shift < 64; shift += 7) {
+			unsigned char c = *p++;
+			v |= uint64_t(c & 0x7f) << shift;
+			if (!(c & 0x80)) return v;
+		}
+		throw std::runtime_error("truncated episode record");
+	}
+	static void put_string(std::string& buf, const std::string& str) {
+		put_varint(buf, str.size());
+		buf.append(str);
+	}
+	static std::string get_string(const char*& p, const char* end) {
+		size_t size = get_varint(p, end);
+		if (size_t(end - p) < size) throw std::runtime_error("truncated episode record");
+		p += size;
+		return std::string(p - size, size);
+	}
+	time_t& spent(unsigned who) {
+		return who == action::slide::type ? ep_slide : ep_place;
+	}
 
 private:
 	board ep_state;
 	board::reward ep_score;
-	std::vector<move> ep_moves;
+	std::vector<uint16_t> ep_moves; // packed moves, see pack()
 	time_t ep_time;
+	time_t ep_span; // time totals in nanoseconds
+	time_t ep_slide;
+	time_t ep_place;
 
 	meta ep_open;
 	meta ep_close;
@@ -0,0 +1,175 @@
+/**
+ * Framework for 2048 & 2048-like Games (C++ 11)
+ * profiler.h: Hardware performance counters of the move selection and the TD update
+ *
+ * Author: Theory of Computer Games (TCG 2021)
+ *         Computer Games and Intelligence (CGI) Lab, NYCU, Taiwan
+ *         https://cgilab.nctu.edu.tw/
+ */
+
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <iostream>
+#include <iomanip>
+#if defined(__linux__)
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+/**
+ * hardware counters (via perf_event_open on Linux) of the calling thread, counted separately
+ * for each phase, i.e., the player selecting moves and the player updating at the end of episodes
+ *
+ * each phase has a group of counters led by the cycles, which is enabled only inside the scopes
+ * of the phase, and only after open() succeeds (see --profile);
+ * counters not supported by the machine (e.g., in some virtual machines) are reported as N/A
+ */
+class profiler {
+public:
+	enum phase { none = -1, select, update, phases };
+	enum event { cycles, instructions, llc_misses, dtlb_misses, branch_misses, events };
+	struct sample {
+		uint64_t v[phases][events];
+		sample() { std::memset(v, 0, sizeof(v)); }
+		sample operator -(const sample& s) const {
+			sample d;
+			for (int p = 0; p < phases; p++)
+				for (int e = 0; e < events; e++) d.v[p][e] = v[p][e] - s.v[p][e];
+			return d;
+		}
+	};
+
+	/**
+	 * the profiler of the main thread
+	 */
+	static profiler& instance() {
+		static profiler main;
+		return main;
+	}
+
+	/**
+	 * open the counters, or print why they are unavailable and return false
+	 */
+	bool open() {
+#if defined(__linux__)
+		for (int p = 0; p < phases; p++) {
+			for (int e = 0; e < events; e++) {
+				perf_event_attr attr;
+				std::memset(&attr, 0, sizeof(attr));
+				attr.size = sizeof(attr);
+				attr.type = (e == llc_misses || e == dtlb_misses) ? PERF_TYPE_HW_CACHE : PERF_TYPE_HARDWARE;
+				switch (e) {
+				case cycles:        attr.config = PERF_COUNT_HW_CPU_CYCLES; break;
+				case instructions:  attr.config = PERF_COUNT_HW_INSTRUCTIONS; break;
+				case llc_misses:    attr.config = PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16); break;
+				case dtlb_misses:   attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16); break;
+				case branch_misses: attr.config = PERF_COUNT_HW_BRANCH_MISSES; break;
+				}
+				attr.disabled = (e == cycles); // the group follows its leader, i.e., the cycles
+				attr.exclude_kernel = 1;
+				attr.exclude_hv = 1;
+				fd[p][e] = syscall(__NR_perf_event_open, &attr, 0, -1, (e == cycles) ? -1 : fd[p][cycles], 0);
+				if (fd[p][e] < 0 && e == cycles) {
+					bool denied = (errno == EACCES || errno == EPERM);
+					std::cout << "hardware counters unavailable: " << std::strerror(errno);
+					std::cout << (denied ? " (see /proc/sys/kernel/perf_event_paranoid)" : " (not supported by this machine)") << std::endl;
+					close();
+					return false;
+				}
+			}
+		}
+		opened = true;
+		return true;
+#else
+		std::cout << "hardware counters unavailable: perf_event_open is Linux only" << std::endl;
+		return false;
+#endif
+	}
+	bool is_open() const { return opened; }
+
+	/**
+	 * count the events of a phase during the lifetime of the scope, which is a no-op
+	 * for phase 'none' or if the counters are not open (see --profile)
+	 */
+	class scope {
+	public:
+		scope(phase p) : p(instance().opened ? p : none) { if (this->p != none) instance().enable(this->p, true); }
+		~scope() { if (p != none) instance().enable(p, false); }
+	private:
+		phase p;
+	};
+
+	sample read() const {
+		sample s;
+#if defined(__linux__)
+		for (int p = 0; p < phases && opened; p++) {
+			for (int e = 0; e < events; e++) {
+				uint64_t v = 0;
+				if (fd[p][e] >= 0 && ::read(fd[p][e], &v, sizeof(v)) == sizeof(v)) s.v[p][e] = v;
+			}
+		}
+#endif
+		return s;
+	}
+
+	/**
+	 * print the counters of a block, where 'moves' and 'games' are the player moves and the episodes, e.g.,
+	 *        select: 412.3k cycles/move, IPC = 0.72, LLC = 96.1, dTLB = 41.0, branch = 310.2 misses/move
+	 *        update: 8510.2k cycles/game, IPC = 0.64, LLC = 9122.5, dTLB = 3012.7, branch = 2210.4 misses/game
+	 */
+	void report(const sample& d, size_t moves, size_t games) const {
+		const char* name[] = { "select", "update" };
+		const char* unit[] = { "move", "game" };
+		double n[] = { double(std::max<size_t>(moves, 1)), double(std::max<size_t>(games, 1)) };
+		std::ios ff(nullptr);
+		ff.copyfmt(std::cout);
+		std::cout << std::fixed << std::setprecision(1);
+		for (int p = 0; p < phases; p++) {
+			const uint64_t* v = d.v[p];
+			std::cout << "\t" << name[p] << ": " << (v[cycles] / n[p] / 1000) << "k cycles/" << unit[p] << ", ";
+			std::cout << "IPC = " << std::setprecision(2);
+			if (fd[p][instructions] >= 0) std::cout << (v[instructions] * 1.0 / std::max<uint64_t>(v[cycles], 1)) << ", ";
+			else std::cout << "N/A, ";
+			std::cout << std::setprecision(1);
+			const char* miss[] = { "LLC", "dTLB", "branch" };
+			for (int e = llc_misses; e <= branch_misses; e++) {
+				std::cout << miss[e - llc_misses] << " = ";
+				if (fd[p][e] >= 0) std::cout << (v[e] / n[p]);
+				else std::cout << "N/A";
+				std::cout << (e < branch_misses ? ", " : " misses/");
+			}
+			std::cout << unit[p] << std::endl;
+		}
+		std::cout.copyfmt(ff);
+	}
+
+	~profiler() { close(); }
+
+private:
+	profiler() : opened(false) {
+		for (int p = 0; p < phases; p++)
+			for (int e = 0; e < events; e++) fd[p][e] = -1;
+	}
+
+	void enable(phase p, bool on) {
+#if defined(__linux__)
+		if (opened && p != none) ioctl(fd[p][cycles], on ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+#endif
+	}
+	void close() {
+#if defined(__linux__)
+		for (int p = 0; p < phases; p++)
+			for (int e = 0; e < events; e++)
+				if (fd[p][e] >= 0) ::close(fd[p][e]), fd[p][e] = -1;
+#endif
+		opened = false;
+	}
+
+	int fd[phases][events];
+	bool opened;
+};
@@ -0,0 +1,100 @@
+/**
+ * Framework for 2048 & 2048-like Games (C++ 11)
+ * recorder.h: Streaming writer of episode records
+ *
+ * Author: Theory of Computer Games (TCG 2021)
+ *         Computer Games and Intelligence (CGI) Lab, NYCU, Taiwan
+ *         https://cgilab.nctu.edu.tw/
+ */
+
+#pragma once
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <stdexcept>
+#include <memory>
+#include "episode.h"
+#include "archive.h"
+
+/**
+ * append closed episodes to a file from a background thread, in the text format,
+ * or in the binary archive (see archive.h) if the path ends with ".bin"
+ *
+ * episodes are copied into a bounded ring of 'capacity' slots, whose storage is reused,
+ * and the file is flushed after each record, so that a crash loses only the queued episodes
+ * the caller waits only when the ring is full, i.e., when the disk cannot keep up
+ */
+class recorder {
+public:
+	recorder(const std::string& path, size_t capacity = 1024)
+		: ring(std::max(capacity, size_t(1))), head(0), size(0), closing(false), failed(false) {
+		if (archive::named(path)) {
+			bin.reset(new archive::writer(path, episode::rewards | (episode::timing() ? episode::times : 0)));
+		} else {
+			out.open(path, std::ios::out | std::ios::trunc);
+			if (!out.is_open()) throw std::runtime_error("cannot open " + path + " for writing");
+		}
+		worker = std::thread(&recorder::run, this);
+	}
+	recorder(const recorder&) = delete;
+	recorder& operator =(const recorder&) = delete;
+
+	/**
+	 * write the remaining episodes and close the file
+	 */
+	~recorder() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			closing = true;
+		}
+		ready.notify_one();
+		worker.join();
+	}
+
+public:
+	void push(const episode& ep) {
+		std::unique_lock<std::mutex> lock(mutex);
+		space.wait(lock, [this]() { return size < ring.size(); });
+		ring[(head + size++) % ring.size()] = ep;
+		lock.unlock();
+		ready.notify_one();
+	}
+
+private:
+	void run() {
+		episode ep;
+		while (true) {
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				ready.wait(lock, [this]() { return size || closing; });
+				if (size == 0) break;
+				std::swap(ep, ring[head]);
+				head = (head + 1) % ring.size();
+				size--;
+			}
+			space.notify_one();
+			bool ok = bin ? bin->write(ep) : bool(out << ep << std::endl);
+			if (!ok && !failed) {
+				std::cerr << "failed to write episode records" << std::endl;
+				failed = true;
+			}
+		}
+	}
+
+private:
+	std::ofstream out;
+	std::unique_ptr<archive::writer> bin;
+	std::vector<episode> ring;
+	size_t head;
+	size_t size;
+	bool closing;
+	bool failed;
+	std::mutex mutex;
+	std::condition_variable ready;
+	std::condition_variable space;
+	std::thread worker;
+};
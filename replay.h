@@ -0,0 +1,179 @@
+/**
+ * Framework for 2048 & 2048-like Games (C++ 11)
+ * replay.h: Experience replay buffer with background learner threads
+ *
+ * Author: Theory of Computer Games (TCG 2021)
+ *         Computer Games and Intelligence (CGI) Lab, NYCU, Taiwan
+ *         https://cgilab.nctu.edu.tw/
+ */
+
+#pragma once
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <random>
+#include <functional>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include "board.h"
+
+/**
+ * a bounded ring of the latest 'capacity' transitions, pushed by one actor (the player)
+ * and sampled uniformly by 'learners' threads, which apply them in batches of 'batch'
+ *
+ * the ring is lock-free: each slot carries a sequence number, which is odd while the slot is
+ * being written, so that a learner retries a slot whose sequence changed during its copy;
+ * the transition itself is copied as relaxed atomic words, so that a torn copy is discarded
+ * rather than being a data race
+ *
+ * the actor never waits, while the learners sample at most 'ratio' transitions per pushed one,
+ * and sleep until the actor has pushed enough for another batch; the learners owe at most one
+ * ring of samples, i.e., slow learners drop the samples beyond that, as do the learners on close
+ *
+ * each batch is applied with the learning rate last given by rate(), so that the learners
+ * never read the rate while the actor changes it
+ */
+class replay {
+public:
+	/**
+	 * an afterstate, the reward of the next move, and the next afterstate,
+	 * whose value is not used if the afterstate is the last of its episode
+	 */
+	struct transition {
+		board after;
+		board next;
+		float reward;
+		bool last;
+	};
+	typedef std::function<void(std::vector<transition>&, float alpha)> learner;
+
+	replay(size_t capacity, unsigned learners, size_t batch, float ratio, float alpha, const learner& learn)
+		: ring(std::max(capacity, size_t(1))), head(0), pushed(0), sampled(0), batch(std::max(batch, size_t(1))),
+		  lag(std::max(ring.size(), this->batch)), ratio(ratio), alpha(alpha), waiting(0), closing(false) {
+		for (unsigned i = 0; i < std::max(learners, 1u); i++)
+			workers.emplace_back(&replay::run, this, i, learn);
+	}
+	replay(const replay&) = delete;
+	replay& operator =(const replay&) = delete;
+
+	/**
+	 * stop the learners once their current batches are applied, dropping what is left of the quota
+	 */
+	~replay() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			closing.store(true);
+		}
+		wake.notify_all();
+		for (std::thread& worker : workers) worker.join();
+	}
+
+public:
+	/**
+	 * append a transition, overwriting the oldest one if the ring is full (one actor only)
+	 */
+	void push(const transition& t) {
+		uint64_t pos = head.load(std::memory_order_relaxed);
+		slot& s = ring[pos % ring.size()];
+		uint64_t seq = s.seq.load(std::memory_order_relaxed);
+		s.seq.store(seq + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		uint64_t data[words] = {};
+		std::memcpy(data, &t, sizeof(transition));
+		for (size_t i = 0; i < words; i++) s.data[i].store(data[i], std::memory_order_relaxed);
+		s.seq.store(seq + 2, std::memory_order_release);
+		head.store(pos + 1, std::memory_order_release);
+		uint64_t quota = quota_of(pushed.fetch_add(1) + 1);
+		if (waiting.load() && quota >= sampled.load(std::memory_order_relaxed) + batch) {
+			std::lock_guard<std::mutex> lock(mutex);
+			wake.notify_all();
+		}
+	}
+	/**
+	 * set the learning rate of the batches taken from now on
+	 */
+	void rate(float a) {
+		alpha.store(a, std::memory_order_relaxed);
+	}
+
+private:
+	static constexpr size_t words = (sizeof(transition) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+	struct slot {
+		std::atomic<uint64_t> seq;
+		std::atomic<uint64_t> data[words]; // the transition as words, which are read only after written
+		slot() : seq(0) {}
+	};
+
+	/**
+	 * copy a random transition among the filled slots, or return false if the slot is being written
+	 */
+	bool sample(std::mt19937_64& engine, transition& t) {
+		uint64_t filled = std::min<uint64_t>(head.load(std::memory_order_acquire), ring.size());
+		if (filled == 0) return false;
+		slot& s = ring[engine() % filled];
+		uint64_t seq = s.seq.load(std::memory_order_acquire);
+		if (seq & 1) return false;
+		uint64_t data[words];
+		for (size_t i = 0; i < words; i++) data[i] = s.data[i].load(std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (s.seq.load(std::memory_order_relaxed) != seq) return false;
+		std::memcpy(&t, data, sizeof(transition));
+		return true;
+	}
+
+	uint64_t quota_of(uint64_t pushed) const {
+		return uint64_t(ratio * pushed);
+	}
+
+	/**
+	 * reserve the next batch within the quota, where the samples owed beyond 'lag' are dropped,
+	 * or return false if there is none
+	 */
+	bool reserve() {
+		uint64_t taken = sampled.load();
+		while (true) {
+			uint64_t quota = quota_of(pushed.load());
+			uint64_t from = std::max(taken, quota > lag ? quota - lag : 0);
+			if (from + batch > quota) return false;
+			if (sampled.compare_exchange_weak(taken, from + batch)) return true;
+		}
+	}
+
+	void run(unsigned id, learner learn) {
+		std::mt19937_64 engine(id);
+		std::vector<transition> samples;
+		samples.reserve(batch);
+		while (!closing.load()) {
+			if (!reserve()) {
+				std::unique_lock<std::mutex> lock(mutex);
+				waiting++;
+				wake.wait(lock, [&]() { return closing.load() || quota_of(pushed.load()) >= sampled.load() + batch; });
+				waiting--;
+				continue;
+			}
+			samples.clear();
+			transition t;
+			while (samples.size() < batch)
+				if (sample(engine, t)) samples.push_back(t);
+			learn(samples, alpha.load(std::memory_order_relaxed));
+		}
+	}
+
+private:
+	std::vector<slot> ring;
+	std::atomic<uint64_t> head;
+	std::atomic<uint64_t> pushed;
+	std::atomic<uint64_t> sampled;
+	size_t batch;
+	uint64_t lag; // the most samples the learners may owe
+	float ratio;
+	std::atomic<float> alpha;
+	std::atomic<unsigned> waiting; // the learners waiting for the quota
+	std::atomic<bool> closing;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::vector<std::thread> workers;
+};
@@ -0,0 +1,177 @@
+/**
+ * Framework for 2048 & 2048-like Games (C++ 11)
+ * rng.h: Portable pseudo-random number engines for agents
+ *
+ * Author: Theory of Computer Games (TCG 2021)
+ *         Computer Games and Intelligence (CGI) Lab, NYCU, Taiwan
+ *         https://cgilab.nctu.edu.tw/
+ */
+
+#pragma once
+#include <cstdint>
+#include <string>
+#include <stdexcept>
+#include <utility>
+
+/**
+ * SplitMix64, also used to expand seeds for the other engines
+ */
+class splitmix64 {
+public:
+	typedef uint64_t result_type;
+	static constexpr result_type min() { return 0; }
+	static constexpr result_type max() { return ~result_type(0); }
+
+	splitmix64(uint64_t seed = 0) : s(seed) {}
+	void seed(uint64_t seed) { s = seed; }
+	result_type operator()() { return mix(s += 0x9e3779b97f4a7c15ull); }
+
+	static uint64_t mix(uint64_t z) {
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+		return z ^ (z >> 31);
+	}
+
+private:
+	uint64_t s;
+};
+
+/**
+ * xoshiro256++ by Blackman and Vigna
+ */
+class xoshiro256pp {
+public:
+	typedef uint64_t result_type;
+	static constexpr result_type min() { return 0; }
+	static constexpr result_type max() { return ~result_type(0); }
+
+	xoshiro256pp(uint64_t seed = 0) { this->seed(seed); }
+	void seed(uint64_t seed) {
+		splitmix64 sm(seed);
+		for (uint64_t& v : s) v = sm();
+	}
+	result_type operator()() {
+		uint64_t res = rotl(s[0] + s[3], 23) + s[0];
+		uint64_t t = s[1] << 17;
+		s[2] ^= s[0];
+		s[3] ^= s[1];
+		s[1] ^= s[2];
+		s[0] ^= s[3];
+		s[2] ^= t;
+		s[3] = rotl(s[3], 45);
+		return res;
+	}
+
+private:
+	static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+	uint64_t s[4];
+};
+
+/**
+ * PCG64 (128-bit LCG state with the XSL-RR output) by O'Neill
+ */
+class pcg64 {
+public:
+	typedef uint64_t result_type;
+	static constexpr result_type min() { return 0; }
+	static constexpr result_type max() { return ~result_type(0); }
+
+	pcg64(uint64_t seed = 0) { this->seed(seed); }
+	void seed(uint64_t seed) {
+		splitmix64 sm(seed);
+		unsigned __int128 init = (unsigned __int128)(sm()) << 64 | sm();
+		unsigned __int128 seq = (unsigned __int128)(sm()) << 64 | sm();
+		state = 0;
+		inc = (seq << 1) | 1;
+		step();
+		state += init;
+		step();
+	}
+	result_type operator()() {
+		step();
+		uint64_t x = uint64_t(state >> 64) ^ uint64_t(state);
+		unsigned rot = unsigned(state >> 122);
+		return (x >> rot) | (x << ((64 - rot) & 63));
+	}
+
+private:
+	void step() {
+		const unsigned __int128 mul = (unsigned __int128)(0x2360ed051fc65da4ull) << 64 | 0x4385df649fccf645ull;
+		state = state * mul + inc;
+	}
+	unsigned __int128 state;
+	unsigned __int128 inc;
+};
+
+/**
+ * engine selected by name at runtime, i.e., "xoshiro" (xoshiro256++, the default), "pcg" (PCG64),
+ * or "splitmix" (SplitMix64), which produces the same sequences on every platform and library
+ *
+ * the stream of an episode is defined by the seed and the episode index only,
+ * see reseed(), so that episode i gets the same stream no matter which thread plays it
+ */
+class rng {
+public:
+	typedef uint64_t result_type;
+	static constexpr result_type min() { return 0; }
+	static constexpr result_type max() { return ~result_type(0); }
+
+	enum kind { xoshiro, pcg, splitmix };
+
+	rng(const std::string& name = "xoshiro", uint64_t seed = 0) : type(parse(name)) { this->seed(seed); }
+
+	void seed(uint64_t seed) {
+		switch (type) {
+		case xoshiro: xo.seed(seed); break;
+		case pcg: pc.seed(seed); break;
+		case splitmix: sm.seed(seed); break;
+		}
+	}
+	/**
+	 * seed the stream of the given episode
+	 */
+	void reseed(uint64_t seed, uint64_t episode) {
+		this->seed(splitmix64::mix(seed ^ splitmix64::mix(episode + 0x9e3779b97f4a7c15ull)));
+	}
+
+	result_type operator()() {
+		switch (type) {
+		default:
+		case xoshiro: return xo();
+		case pcg: return pc();
+		case splitmix: return sm();
+		}
+	}
+
+	/**
+	 * a uniform draw in [0, bound) for bound > 0, by Lemire's multiply-high with rejection,
+	 * instead of std::uniform_int_distribution, whose algorithm differs between libraries
+	 */
+	uint64_t uniform(uint64_t bound) {
+		unsigned __int128 m = (unsigned __int128)((*this)()) * bound;
+		if (uint64_t(m) < bound) {
+			uint64_t threshold = (0 - bound) % bound;
+			while (uint64_t(m) < threshold) m = (unsigned __int128)((*this)()) * bound;
+		}
+		return uint64_t(m >> 64);
+	}
+	/**
+	 * Fisher-Yates shuffle on uniform(), instead of std::shuffle, whose algorithm differs between libraries
+	 */
+	template<typename iterator> void shuffle(iterator first, iterator last) {
+		for (uint64_t n = last - first; n > 1; n--) std::swap(first[n - 1], first[uniform(n)]);
+	}
+
+	static kind parse(const std::string& name) {
+		if (name == "xoshiro" || name == "xoshiro256++") return xoshiro;
+		if (name == "pcg" || name == "pcg64") return pcg;
+		if (name == "splitmix" || name == "splitmix64") return splitmix;
+		throw std::invalid_argument("unknown rng " + name);
+	}
+
+private:
+	kind type;
+	xoshiro256pp xo;
+	pcg64 pc;
+	splitmix64 sm;
+};
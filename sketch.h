@@ -0,0 +1,73 @@
+/**
+ * Framework for 2048 & 2048-like Games (C++ 11)
+ * sketch.h: Mergeable quantile sketch for statistical reports
+ *
+ * Author: Theory of Computer Games (TCG 2021)
+ *         Computer Games and Intelligence (CGI) Lab, NYCU, Taiwan
+ *         https://cgilab.nctu.edu.tw/
+ */
+
+#pragma once
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+
+/**
+ * quantile sketch of non-negative values with logarithmic buckets (DDSketch style)
+ *
+ * a value v > 0 is counted in bucket ceil(log_gamma(v)), where gamma = (1 + a) / (1 - a),
+ * so that any quantile is estimated within a relative error of a = 1%
+ * the memory is bounded by the number of buckets, e.g., about 1100 buckets for values below 2^32,
+ * and sketches are merged by adding the bucket counts
+ */
+class sketch {
+public:
+	sketch() : zeros(0), count(0) {}
+
+public:
+	void add(double v) {
+		count++;
+		if (v < 1) {
+			zeros++;
+			return;
+		}
+		size_t i = std::ceil(std::log(v) / std::log(gamma()) - 1e-9);
+		if (i >= bins.size()) bins.resize(i + 1, 0);
+		bins[i]++;
+	}
+	void merge(const sketch& s) {
+		if (s.bins.size() > bins.size()) bins.resize(s.bins.size(), 0);
+		for (size_t i = 0; i < s.bins.size(); i++) bins[i] += s.bins[i];
+		zeros += s.zeros;
+		count += s.count;
+	}
+	void clear() {
+		bins.clear();
+		zeros = 0;
+		count = 0;
+	}
+
+	/**
+	 * the estimated q-quantile (0 <= q <= 1), which is 0 if the sketch is empty
+	 */
+	double quantile(double q) const {
+		if (count == 0) return 0;
+		size_t rank = std::floor(std::max(0.0, std::min(q, 1.0)) * (count - 1));
+		if (rank < zeros) return 0;
+		size_t seen = zeros;
+		for (size_t i = 0; i < bins.size(); i++) {
+			seen += bins[i];
+			if (seen > rank) return 2 * std::pow(gamma(), i) / (gamma() + 1);
+		}
+		return 2 * std::pow(gamma(), bins.size() - 1) / (gamma() + 1);
+	}
+	size_t size() const { return count; }
+
+private:
+	static double gamma() { return 1.01 / 0.99; }
+
+	std::vector<size_t> bins;
+	size_t zeros;
+	size_t count;
+};
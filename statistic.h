@@ -8,21 +8,34 @@
  */
 
 #pragma once
-#include <list>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <exception>
+#include <iterator>
 #include <algorithm>
 #include <iostream>
 #include <sstream>
+#include <memory>
+#include <limits>
+#include <fstream>
+#include <stdexcept>
 #include "board.h"
 #include "action.h"
 #include "agent.h"
 #include "episode.h"
+#include "archive.h"
+#include "recorder.h"
+#include "sketch.h"
+#include "counter.h"
+#include "profiler.h"
 
 class statistic {
 public:
 	/**
 	 * the total episodes to run
 	 * the block size of statistic
-	 * the limit of saving records
+	 * the limit of records covered by the summary
 	 *
 	 * note that total >= limit >= block
 	 */
@@ -30,7 +43,52 @@ public:
 		: total(total),
 		  block(block ? block : total),
 		  limit(limit ? limit : total),
-		  count(0) {}
+		  count(0), opened(episode::nanosec()) {}
+
+public:
+	/**
+	 * the running aggregates of episodes, which can be merged, e.g., across threads or blocks
+	 */
+	struct accumulator {
+		size_t games;
+		uint64_t sum;
+		board::reward max;
+		size_t tile[64]; // the number of episodes ended with each largest tile
+		size_t steps[3]; // total, slide, place
+		time_t times[3]; // total, slide, place
+		sketch scores;
+		sketch lengths; // the number of steps
+
+		accumulator() { clear(); }
+		void clear() {
+			games = 0;
+			sum = 0;
+			max = 0;
+			std::fill(std::begin(tile), std::end(tile), 0);
+			std::fill(std::begin(steps), std::end(steps), 0);
+			std::fill(std::begin(times), std::end(times), 0);
+			scores.clear();
+			lengths.clear();
+		}
+		void add(const episode::digest& ep) {
+			games++;
+			sum += ep.score;
+			max = std::max(ep.score, max);
+			tile[ep.tile]++;
+			for (int i = 0; i < 3; i++) steps[i] += ep.steps[i], times[i] += ep.times[i];
+			scores.add(ep.score);
+			lengths.add(ep.steps[0]);
+		}
+		void merge(const accumulator& acc) {
+			games += acc.games;
+			sum += acc.sum;
+			max = std::max(acc.max, max);
+			for (int t = 0; t < 64; t++) tile[t] += acc.tile[t];
+			for (int i = 0; i < 3; i++) steps[i] += acc.steps[i], times[i] += acc.times[i];
+			scores.merge(acc.scores);
+			lengths.merge(acc.lengths);
+		}
+	};
 
 public:
 	/**
@@ -38,6 +96,8 @@ public:
 	 *
 	 * the format would be
 	 * 1000   avg = 273901, max = 382324, ops = 241563 (170543|896715)
+	 *        score   p50 = 281020, p90 = 361270, p99 = 378340, p99.9 = 382060
+	 *        steps   p50 = 9841, p90 = 12474, p99 = 13489, p99.9 = 13762
 	 *        512     100%   (0.3%)
 	 *        1024    99.7%  (0.2%)
 	 *        2048    99.5%  (1.1%)
@@ -52,28 +112,27 @@ public:
 	 *  'ops = 241563 (170543|896715)': the average speed is 241563
 	 *                                  the average speed of player is 170543
 	 *                                  the average speed of environment is 896715
+	 *                                  which is 'N/A' if timing is switched off
+	 *  'p90 = 361270': 90% of games scored at most about 361270 (within 1%, see sketch.h)
+	 *  'p90 = 12474': 90% of games ended within about 12474 steps
 	 *  '93.7%': 93.7% (937 games) reached 8192-tiles (a.k.a. win rate of 8192-tile)
 	 *  '22.4%': 22.4% (224 games) terminated with 8192-tiles (the largest)
 	 */
 	void show(bool tstat = true) const {
-		size_t blk = std::min(data.size(), block);
-		size_t stat[64] = { 0 };
-		size_t sop = 0, pop = 0, eop = 0;
-		time_t sdu = 0, pdu = 0, edu = 0;
-		board::reward sum = 0, max = 0;
-		auto it = data.end();
-		for (size_t i = 0; i < blk; i++) {
-			auto& ep = *(--it);
-			sum += ep.score();
-			max = std::max(ep.score(), max);
-			stat[*std::max_element(&(ep.state()(0)), &(ep.state()(16)))]++;
-			sop += ep.step();
-			pop += ep.step(action::slide::type);
-			eop += ep.step(action::place::type);
-			sdu += ep.time();
-			pdu += ep.time(action::slide::type);
-			edu += ep.time(action::place::type);
-		}
+		show(blocks.size() ? blocks.back() : current_block, tstat);
+	}
+	/**
+	 * show the statistic of the given games, followed by the instrumentation counters
+	 * (see counter.h) and the hardware counters (see profiler.h) of the block if given
+	 */
+	void show(const accumulator& acc, bool tstat = true, const counter::set* counters = nullptr, uint64_t wall = 0,
+			const profiler::sample* hw = nullptr) const {
+		size_t blk = acc.games;
+		const size_t* stat = acc.tile;
+		size_t sop = acc.steps[0], pop = acc.steps[1], eop = acc.steps[2];
+		time_t sdu = acc.times[0], pdu = acc.times[1], edu = acc.times[2];
+		uint64_t sum = acc.sum;
+		board::reward max = acc.max;
 
 		std::ios ff(nullptr);
 		ff.copyfmt(std::cout);
@@ -81,16 +140,34 @@ public:
 		std::cout << count << "\t";
 		std::cout << "avg = " << (sum / blk) << ", ";
 		std::cout << "max = " << (max) << ", ";
-		std::cout << "ops = " << (sop * 1000.0 / sdu);
-		std::cout <<     " (" << (pop * 1000.0 / pdu);
-		std::cout <<      "|" << (eop * 1000.0 / edu) << ")";
+		if (sdu && pdu && edu) {
+			std::cout << "ops = " << (sop * 1e9 / sdu);
+			std::cout <<     " (" << (pop * 1e9 / pdu);
+			std::cout <<      "|" << (eop * 1e9 / edu) << ")";
+		} else {
+			std::cout << "ops = N/A";
+		}
 		std::cout << std::endl;
+		if (tstat) {
+			const sketch* dist[] = { &acc.scores, &acc.lengths };
+			const char* name[] = { "score", "steps" };
+			for (int i = 0; i < 2; i++) {
+				std::cout << "\t" << name[i] << "\t";
+				std::cout << "p50 = " << dist[i]->quantile(0.5) << ", ";
+				std::cout << "p90 = " << dist[i]->quantile(0.9) << ", ";
+				std::cout << "p99 = " << dist[i]->quantile(0.99) << ", ";
+				std::cout << "p99.9 = " << dist[i]->quantile(0.999);
+				std::cout << std::endl;
+			}
+		}
+		if (counters) counter::report(*counters, acc.steps[1], acc.games, wall);
+		if (hw) profiler::instance().report(*hw, acc.steps[1], acc.games);
 		std::cout.copyfmt(ff);
 
 		if (!tstat) return;
 		for (size_t t = 0, c = 0; c < blk; c += stat[t++]) {
 			if (stat[t] == 0) continue;
-			unsigned accu = std::accumulate(std::begin(stat) + t, std::end(stat), 0);
+			unsigned accu = std::accumulate(stat + t, stat + 64, 0);
 			std::cout << "\t" << board::fib(t); // type
 			std::cout << "\t" << (accu * 100.0 / blk) << "%"; // win rate
 			std::cout << "\t" "(" << (stat[t] * 100.0 / blk) << "%" ")"; // percentage of ending
@@ -99,52 +176,293 @@ public:
 		std::cout << std::endl;
 	}
 
+	/**
+	 * show the statistic of all games, or of the last 'limit' games (rounded to blocks) if some are beyond it
+	 */
 	void summary() const {
-		auto block_temp = block;
-		const_cast<statistic&>(*this).block = data.size();
-		show();
-		const_cast<statistic&>(*this).block = block_temp;
+		if (overall.games == 0) return;
+		if (count <= limit || blocks.empty()) return show(overall);
+		accumulator acc = current_block;
+		for (auto it = blocks.rbegin(); it != blocks.rend() && acc.games + it->games <= limit; it++) acc.merge(*it);
+		if (acc.games == 0) acc = blocks.back(); // no block fits within 'limit', so cover the newest one
+		show(acc);
 	}
 
 	bool is_finished() const {
 		return count >= total;
 	}
 
+	/**
+	 * open a new episode, whose storage is reused across episodes
+	 */
 	void open_episode(const std::string& flag = "") {
-		if (count++ >= limit) data.pop_front();
-		data.emplace_back();
-		data.back().open_episode(flag);
+		current.clear();
+		current.open_episode(flag);
 	}
 
 	void close_episode(const std::string& flag = "") {
-		data.back().close_episode(flag);
-		if (count % block == 0) show();
+		current.close_episode(flag);
+		close_episode(current);
+	}
+
+	/**
+	 * add an episode which has been opened and closed elsewhere, e.g., in a lockstep slot,
+	 * which is then cleared for reuse
+	 *
+	 * only the aggregates of the episode are kept, while the episode itself
+	 * is handed to the recorder if it is streaming
+	 */
+	void close_episode(episode& ep) {
+		episode::digest d = ep.summarize();
+		current_block.add(d);
+		overall.add(d);
+		count++;
+		if (log) log->push(ep);
+		ep.clear();
+		if (count % block == 0) {
+			// keep the blocks needed by the summary only if it may not cover all games
+			if (limit < total) retain(current_block);
+			profiler::sample hw = profiler::instance().read(), hw_delta = hw - profiled;
+			profiled = hw;
+#if defined(COUNTERS)
+			counter::set now = counter::total(), delta = now - counters;
+			uint64_t wall = counter::nanosec() - counted;
+			show(current_block, true, &delta, wall, profiler::instance().is_open() ? &hw_delta : nullptr);
+			counters = now;
+			counted = counter::nanosec();
+#else
+			show(current_block, true, nullptr, 0, profiler::instance().is_open() ? &hw_delta : nullptr);
+#endif
+			if (out) export_block(current_block);
+			std::stringstream report;
+			report << "block=" << count << "," << (current_block.sum * 1.0 / current_block.games);
+			for (agent* who : listeners) who->notify(report.str());
+			current_block.clear();
+		}
 	}
 
-	episode& at(size_t i) {
-		auto it = data.begin();
-		while (i--) it++;
-		return *it;
+	/**
+	 * notify an agent of each block report by "block=episodes,avg", e.g., "block=1000,273901.5",
+	 * where 'episodes' counts all the episodes so far and 'avg' is the average score of the block
+	 */
+	void subscribe(agent& who) {
+		listeners.push_back(&who);
 	}
-	episode& front() {
-		return data.front();
+
+	/**
+	 * the number of episodes yet to be added
+	 */
+	size_t remain() const {
+		return total - std::min(count, total);
 	}
+
+	/**
+	 * the episode being played
+	 */
 	episode& back() {
-		return data.back();
+		return current;
 	}
 
-	friend std::ostream& operator <<(std::ostream& out, const statistic& stat) {
-		for (const episode& rec : stat.data) out << rec << std::endl;
-		return out;
+	/**
+	 * also write a machine-readable record of each block to the given file (or the standard error if
+	 * the path is empty, apart from the human-readable report on the standard output), which is flushed
+	 * immediately so that it can be tailed, in the given format:
+	 *  "json": one object per line, e.g.,
+	 *    {"index":1000,"games":1000,"avg":273901,"max":382324,"ops":{"total":241563,"play":170543,"evil":896715},
+	 *     "tiles":{"512":3,...},"score":{"p50":281020,...},"steps":{"p50":9841,...},"when":1620000000000,"elapsed":12.3}
+	 *    where "ops" is null if timing is switched off
+	 *  "csv": a header and then one line per block, with the tiles as "512:3;1024:2;..."
+	 * where 'when' is the wall clock time in milliseconds and 'elapsed' is the wall time of the block in seconds
+	 */
+	void export_stats(const std::string& path, const std::string& format = "json") {
+		if (format != "json" && format != "csv") throw std::invalid_argument("unknown stats format " + format);
+		if (path.size()) {
+			file.reset(new std::ofstream(path, std::ios::out | std::ios::trunc));
+			if (!file->is_open()) throw std::runtime_error("cannot open " + path + " for writing");
+		}
+		out = path.size() ? file.get() : &std::cerr;
+		csv = format == "csv";
+		if (csv) {
+			*out << "index,games,avg,max,ops,ops_play,ops_evil,"
+			        "score_p50,score_p90,score_p99,score_p999,steps_p50,steps_p90,steps_p99,steps_p999,"
+			        "tiles,when,elapsed" << std::endl;
+		}
+	}
+
+	/**
+	 * append every episode to the given file as soon as it is closed, starting with the loaded records
+	 * if they are kept (see load), so that the saved records are no longer bounded by 'limit'
+	 */
+	void stream(const std::string& path) {
+		log.reset(new recorder(path));
+		for (const episode& rec : records) log->push(rec);
+		std::vector<episode>().swap(records);
+	}
+	/**
+	 * finish writing the streamed records
+	 */
+	void close_stream() {
+		log.reset();
+	}
+
+	/**
+	 * load the records from a file in either the text format or the binary archive,
+	 * which is split into ranges of records (or bytes of lines) parsed by multiple threads,
+	 * each of which reads its range from its own stream
+	 *
+	 * each thread keeps the digests of its records, which are then added in order and cut into blocks
+	 * for the summary, and the records themselves are not kept unless 'keep' is set for streaming them again
+	 */
+	void load(const std::string& path, bool keep = false, size_t threads = 0) {
+		if (threads == 0) threads = std::max(std::thread::hardware_concurrency(), 1u);
+		std::vector<std::vector<episode::digest>> digests(threads);
+		std::vector<std::vector<episode>> kept(threads);
+		std::vector<std::exception_ptr> errors(threads);
+		std::vector<std::thread> workers;
+		std::unique_ptr<archive::reader> index; // the archive indexed (or scanned) once, then shared by the threads
+		uint64_t size = 0; // the records in the archive, or the bytes of the text
+
+		if (archive::detect(path)) {
+			index.reset(new archive::reader(path));
+			size = index->size();
+			for (size_t t = 0; t < threads; t++) {
+				workers.emplace_back([&, t]() {
+					try {
+						archive::reader in(*index);
+						episode ep;
+						for (size_t i = size * t / threads; i < size * (t + 1) / threads; i++) {
+							in.read(i, ep);
+							digests[t].push_back(ep.summarize());
+							if (keep) kept[t].push_back(ep);
+						}
+					} catch (...) {
+						errors[t] = std::current_exception();
+					}
+				});
+			}
+		} else {
+			std::ifstream probe(path, std::ios::in | std::ios::binary);
+			if (!probe.is_open()) throw std::runtime_error("cannot open " + path);
+			size = probe.seekg(0, std::ios::end).tellg();
+			for (size_t t = 0; t < threads; t++) {
+				workers.emplace_back([&, t]() {
+					try {
+						// each thread parses the lines starting in its range of bytes from its own stream
+						std::ifstream in(path, std::ios::in | std::ios::binary);
+						if (!in.is_open()) throw std::runtime_error("cannot open " + path);
+						auto boundary = [&](size_t k) -> uint64_t {
+							if (k == 0) return 0;
+							if (k >= threads) return size;
+							in.clear();
+							in.seekg(size * k / threads - 1).ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+							return in ? uint64_t(in.tellg()) : size;
+						};
+						uint64_t end = boundary(t + 1), pos = boundary(t);
+						in.clear();
+						in.seekg(pos);
+						episode ep;
+						std::string line;
+						std::istringstream parse;
+						for (; pos < end && std::getline(in, line); pos += line.size() + 1) {
+							if (line.empty()) continue;
+							parse.clear();
+							parse.str(line);
+							parse >> ep;
+							digests[t].push_back(ep.summarize());
+							if (keep) kept[t].push_back(ep);
+						}
+					} catch (...) {
+						errors[t] = std::current_exception();
+					}
+				});
+			}
+		}
+		for (std::thread& worker : workers) worker.join();
+		for (std::exception_ptr& error : errors) if (error) std::rethrow_exception(error);
+
+		for (size_t t = 0; t < threads; t++) {
+			count += digests[t].size();
+			std::move(kept[t].begin(), kept[t].end(), std::back_inserter(records));
+		}
+		total = std::max(total, count);
+		// the loaded games are cut into blocks as if they were played, so that the summary covers them within 'limit'
+		accumulator loaded;
+		bool cut = block && limit < total; // blocks are not kept with block == 0, e.g., for --total=0
+		for (size_t t = 0; t < threads; t++) {
+			for (const episode::digest& d : digests[t]) {
+				overall.add(d);
+				if (!cut) continue;
+				loaded.add(d);
+				if (loaded.games < block) continue;
+				retain(loaded);
+				loaded.clear();
+			}
+		}
+		if (cut && loaded.games) retain(loaded);
+	}
+
+private:
+	/**
+	 * append a completed block, and drop the oldest blocks that are no longer needed to cover 'limit' games
+	 */
+	void retain(const accumulator& acc) {
+		blocks.push_back(acc);
+		size_t games = 0;
+		for (const accumulator& blk : blocks) games += blk.games;
+		while (blocks.size() > 1 && games - blocks.front().games >= limit) {
+			games -= blocks.front().games;
+			blocks.pop_front();
+		}
 	}
-	friend std::istream& operator >>(std::istream& in, statistic& stat) {
-		for (std::string line; std::getline(in, line) && line.size(); ) {
-			stat.data.emplace_back();
-			std::stringstream(line) >> stat.data.back();
+
+	void export_block(const accumulator& acc) {
+		time_t now = episode::nanosec();
+		double elapsed = (now - opened) / 1e9;
+		opened = now;
+		std::ostream& o = *out;
+		std::ios ff(nullptr);
+		ff.copyfmt(o);
+		o << std::fixed << std::setprecision(0);
+
+		const time_t* du = acc.times;
+		bool timed = du[0] && du[1] && du[2];
+		double ops[] = { acc.steps[0] * 1e9 / (du[0] ? du[0] : 1),
+		                 acc.steps[1] * 1e9 / (du[1] ? du[1] : 1),
+		                 acc.steps[2] * 1e9 / (du[2] ? du[2] : 1) };
+		const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+		const char* names[] = { "p50", "p90", "p99", "p999" };
+		std::stringstream tiles;
+		for (int t = 0; t < 64; t++) {
+			if (acc.tile[t] == 0) continue;
+			if (tiles.tellp()) tiles << (csv ? ";" : ",");
+			if (csv) tiles << board::fib(t) << ':' << acc.tile[t];
+			else tiles << '"' << board::fib(t) << "\":" << acc.tile[t];
+		}
+
+		if (csv) {
+			o << count << ',' << acc.games << ',' << (acc.sum / acc.games) << ',' << acc.max << ',';
+			for (double v : ops) timed ? (o << v << ',') : (o << ',');
+			for (double q : quantiles) o << acc.scores.quantile(q) << ',';
+			for (double q : quantiles) o << acc.lengths.quantile(q) << ',';
+			o << tiles.str() << ',' << episode::millisec() << ',';
+			o << std::setprecision(3) << elapsed << std::endl;
+		} else {
+			o << "{\"index\":" << count << ",\"games\":" << acc.games;
+			o << ",\"avg\":" << (acc.sum / acc.games) << ",\"max\":" << acc.max << ",\"ops\":";
+			if (timed) o << "{\"total\":" << ops[0] << ",\"play\":" << ops[1] << ",\"evil\":" << ops[2] << "}";
+			else o << "null";
+			o << ",\"tiles\":{" << tiles.str() << "}";
+			const sketch* dist[] = { &acc.scores, &acc.lengths };
+			const char* dists[] = { "score", "steps" };
+			for (int i = 0; i < 2; i++) {
+				o << ",\"" << dists[i] << "\":{";
+				for (int k = 0; k < 4; k++) o << (k ? "," : "") << '"' << names[k] << "\":" << dist[i]->quantile(quantiles[k]);
+				o << "}";
+			}
+			o << ",\"when\":" << episode::millisec();
+			o << ",\"elapsed\":" << std::setprecision(3) << elapsed << "}" << std::endl;
 		}
-		stat.total = std::max(stat.total, stat.data.size());
-		stat.count = stat.data.size();
-		return in;
+		o.copyfmt(ff);
 	}
 
 private:
@@ -152,5 +470,20 @@ private:
 	size_t block;
 	size_t limit;
 	size_t count;
-	std::list<episode> data;
+	accumulator current_block;
+	accumulator overall;
+	std::deque<accumulator> blocks; // the last completed blocks within 'limit'
+	episode current;
+	std::vector<episode> records; // the loaded records to be streamed
+	std::unique_ptr<recorder> log;
+	std::unique_ptr<std::ofstream> file; // the machine-readable records
+	std::ostream* out = nullptr;
+	bool csv = false;
+	time_t opened; // the start time of the current block
+	profiler::sample profiled; // the hardware counters at the start of the current block
+	std::vector<agent*> listeners; // the agents notified of each block report
+#if defined(COUNTERS)
+	counter::set counters; // the counters at the start of the current block
+	uint64_t counted = counter::nanosec();
+#endif
 };
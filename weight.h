@@ -10,40 +10,479 @@
 #pragma once
 #include <iostream>
 #include <vector>
+#include <array>
+#include <algorithm>
 #include <utility>
+#include <string>
+#include <cstdint>
+#include <stdexcept>
+#include <thread>
+#include <atomic>
+#include <cstring>
+#include <cstdlib>
+#include <new>
+#include "board.h"
 
+/**
+ * lookup table of an n-tuple feature
+ *
+ * a table may carry its pattern descriptor, i.e., the cells (1-d form) and the tile base,
+ * then the table has base^cells entries and indexof() maps a board to its entry
+ *
+ * the updates through update() mark their page (of 'page' entries) as dirty, which is tracked
+ * for delta snapshots until clean() is called; plain accesses through operator[] are not tracked
+ */
 class weight {
 public:
 	typedef float type;
 
+	/**
+	 * allocator of tables, which takes zero pages from calloc and leaves them untouched on
+	 * value-initialization, so that the unvisited part of a huge table costs no memory
+	 */
+	template<typename T> struct zero_allocator {
+		typedef T value_type;
+		zero_allocator() {}
+		template<typename U> zero_allocator(const zero_allocator<U>&) {}
+		T* allocate(size_t n) {
+			void* p = std::calloc(n, sizeof(T));
+			if (!p) throw std::bad_alloc();
+			return static_cast<T*>(p);
+		}
+		void deallocate(T* p, size_t) { std::free(p); }
+		template<typename U> void construct(U* p) {}
+		template<typename U, typename... args> void construct(U* p, args&&... v) { ::new((void*)p) U(std::forward<args>(v)...); }
+		template<typename U> bool operator ==(const zero_allocator<U>&) const { return true; }
+		template<typename U> bool operator !=(const zero_allocator<U>&) const { return false; }
+	};
+	/**
+	 * entries of a table, which is sized once on construction and never resized, since a resize
+	 * that grows back over old entries would keep their values instead of zeros (see zero_allocator)
+	 */
+	struct table : std::vector<type, zero_allocator<type>> {
+		table() {}
+		explicit table(size_t n) : std::vector<type, zero_allocator<type>>(n) {}
+		void resize(size_t n) = delete;
+		void emplace_back() = delete;
+	};
+
 public:
-	weight() {}
-	weight(size_t len) : value(len) {}
-	weight(weight&& f) : value(std::move(f.value)) {}
+	weight() : base(0), length(0), at() {}
+	weight(size_t len) : value(len), base(0), length(0), at() { clean(); }
+	weight(const std::vector<unsigned>& cells, unsigned base) : value(capacity(cells.size(), base)), cells(cells), base(base) { locate(); clean(); }
+	weight(weight&& f) : value(std::move(f.value)), dirty(std::move(f.dirty)), cells(std::move(f.cells)), base(f.base), length(f.length), at(f.at) {}
 	weight(const weight& f) = default;
 
 	weight& operator =(const weight& f) = default;
+	weight& operator =(weight&& f) = default;
 	type& operator[] (size_t i) { return value[i]; }
 	const type& operator[] (size_t i) const { return value[i]; }
 	size_t size() const { return value.size(); }
 
+	/**
+	 * add delta to entry i, and mark its page as dirty
+	 */
+	void update(size_t i, type delta) {
+		dirty[i / page / 64] |= uint64_t(1) << (i / page % 64);
+		value[i] += delta;
+	}
+
+	static constexpr size_t page = 256;
+
+	/**
+	 * forget the dirty pages, e.g., after saving or loading a full snapshot
+	 */
+	void clean() {
+		dirty.assign((pages() + 63) / 64, 0);
+	}
+	size_t pages() const {
+		return (size() + page - 1) / page;
+	}
+	bool touched(size_t p) const {
+		return dirty[p / 64] & (uint64_t(1) << (p % 64));
+	}
+
+	const std::vector<unsigned>& pattern() const { return cells; }
+	unsigned radix() const { return base; }
+
+	/**
+	 * the index of the board in this table, e.g., for pattern (0, 1, 2) with base 31,
+	 * the index is b(0) * 31 * 31 + b(1) * 31 + b(2)
+	 *
+	 * the 4- and 5-tuples with base 31 are unrolled with a constant base, as this runs
+	 * for every table on every evaluation
+	 */
+	size_t indexof(const board& b) const {
+		static_assert(sizeof(board::grid) == 16 * sizeof(board::cell), "the grid must be contiguous");
+		const board::cell* t = &b[0][0]; // the cells in 1-d form
+		if (base == 31 && length == 5)
+			return (((size_t(t[at[0]]) * 31 + t[at[1]]) * 31 + t[at[2]]) * 31 + t[at[3]]) * 31 + t[at[4]];
+		if (base == 31 && length == 4)
+			return ((size_t(t[at[0]]) * 31 + t[at[1]]) * 31 + t[at[2]]) * 31 + t[at[3]];
+		size_t index = 0;
+		for (unsigned i = 0; i < length; i++) index = index * base + t[at[i]];
+		return index;
+	}
+
+	/**
+	 * whether two tables have the same descriptor and size
+	 */
+	bool conform(const weight& w) const {
+		return cells == w.cells && base == w.base && size() == w.size();
+	}
+
+	/**
+	 * describe the table, e.g., "(0,1,2,3)^31"
+	 */
+	std::string signature() const {
+		return signature(cells, base, size());
+	}
+	static std::string signature(const std::vector<unsigned>& cells, unsigned base, size_t size) {
+		std::string sign;
+		for (unsigned cell : cells) sign += (sign.size() ? "," : "(") + std::to_string(cell);
+		return (sign.size() ? sign + ")^" + std::to_string(base) : "[" + std::to_string(size) + "]");
+	}
+
+	static size_t capacity(size_t length, unsigned base) {
+		size_t size = 1;
+		while (length--) size *= base;
+		return size;
+	}
+
 public:
-	friend std::ostream& operator <<(std::ostream& out, const weight& w) {
-		auto& value = w.value;
+	/**
+	 * CRC-32 (IEEE 802.3) of a byte range, sliced by 8 bytes per step
+	 */
+	static uint32_t crc32(const void* data, size_t len, uint32_t crc = 0) {
+		static const std::vector<std::array<uint32_t, 256>> table = crc32_table();
+		const unsigned char* p = static_cast<const unsigned char*>(data);
+		crc = ~crc;
+		for (; len >= 8; len -= 8, p += 8) {
+			uint32_t lo = crc ^ (uint32_t(p[0]) | uint32_t(p[1]) << 8 | uint32_t(p[2]) << 16 | uint32_t(p[3]) << 24);
+			uint32_t hi = uint32_t(p[4]) | uint32_t(p[5]) << 8 | uint32_t(p[6]) << 16 | uint32_t(p[7]) << 24;
+			crc = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff] ^ table[5][(lo >> 16) & 0xff] ^ table[4][lo >> 24]
+			    ^ table[3][hi & 0xff] ^ table[2][(hi >> 8) & 0xff] ^ table[1][(hi >> 16) & 0xff] ^ table[0][hi >> 24];
+		}
+		while (len--) crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+		return ~crc;
+	}
+
+public:
+	/**
+	 * codec of the entries in a table record
+	 *
+	 * plain:  the entries as they are
+	 * sparse: the entries are cut into chunks of 'chunk' entries, and each chunk is
+	 *         encoded as a series of (zero run, literal run) tokens, see encode()
+	 * delta:  only the dirty pages, see write_delta()
+	 */
+	enum codec : uint32_t { plain = 0, sparse = 1, delta = 2 };
+	static constexpr size_t chunk = size_t(1) << 20;
+
+	/**
+	 * the table record of a weight file, all fields are in native byte order
+	 *
+	 * uint32_t base       tile base of the pattern
+	 * uint32_t length     number of cells in the pattern
+	 * uint32_t cells[]    the cells (1-d form) of the pattern
+	 * uint64_t size       number of entries
+	 * (plain)
+	 * type     value[]    the entries
+	 * uint32_t crc        CRC-32 of the entries
+	 * (sparse)
+	 * uint64_t bytes[]    encoded size of each chunk
+	 * uint32_t check[]    CRC-32 of each encoded chunk
+	 * char     data[]     the encoded chunks
+	 * uint32_t crc        CRC-32 of check[]
+	 *
+	 * the chunks of a sparse record are encoded and decoded by 'threads' threads,
+	 * and decoding writes only the literals into the freshly zeroed table
+	 */
+	std::ostream& write(std::ostream& out, codec code = plain, unsigned threads = 1) const {
+		if (code == delta) return write_delta(out);
 		uint64_t size = value.size();
-		out.write(reinterpret_cast<const char*>(&size), sizeof(uint64_t));
-		out.write(reinterpret_cast<const char*>(value.data()), sizeof(type) * size);
+		describe(out);
+		if (code == plain) {
+			uint32_t crc = crc32(value.data(), sizeof(type) * size);
+			out.write(reinterpret_cast<const char*>(value.data()), sizeof(type) * size);
+			out.write(reinterpret_cast<const char*>(&crc), sizeof(uint32_t));
+			return out;
+		}
+		size_t count = (size + chunk - 1) / chunk;
+		std::vector<std::string> data(count);
+		std::vector<uint64_t> bytes(count);
+		std::vector<uint32_t> check(count);
+		parallel(count, threads, [&](size_t i) {
+			size_t len = std::min(size_t(chunk), value.size() - i * chunk);
+			encode(value.data() + i * chunk, len, data[i]);
+			bytes[i] = data[i].size();
+			check[i] = crc32(data[i].data(), data[i].size());
+		});
+		uint32_t crc = crc32(check.data(), sizeof(uint32_t) * count);
+		out.write(reinterpret_cast<const char*>(bytes.data()), sizeof(uint64_t) * count);
+		out.write(reinterpret_cast<const char*>(check.data()), sizeof(uint32_t) * count);
+		for (const std::string& dat : data) out.write(dat.data(), dat.size());
+		out.write(reinterpret_cast<const char*>(&crc), sizeof(uint32_t));
+		return out;
+	}
+	std::istream& read(std::istream& in, codec code = plain, unsigned threads = 1) {
+		if (code == delta) throw std::runtime_error("a delta snapshot needs a base");
+		uint32_t crc = 0;
+		uint64_t size = describe(in, cells, base);
+		locate();
+		table(size).swap(value);
+		clean();
+		if (code == plain) {
+			in.read(reinterpret_cast<char*>(value.data()), sizeof(type) * size);
+			in.read(reinterpret_cast<char*>(&crc), sizeof(uint32_t));
+			if (!in) throw std::runtime_error("table " + signature() + " is truncated");
+			if (crc != crc32(value.data(), sizeof(type) * size))
+				throw std::runtime_error("table " + signature() + " fails the checksum");
+			return in;
+		}
+		size_t count = (size + chunk - 1) / chunk;
+		std::vector<uint64_t> bytes(count);
+		std::vector<uint32_t> check(count);
+		in.read(reinterpret_cast<char*>(bytes.data()), sizeof(uint64_t) * count);
+		in.read(reinterpret_cast<char*>(check.data()), sizeof(uint32_t) * count);
+		std::vector<std::string> data(count);
+		for (size_t i = 0; i < count && in; i++) {
+			if (bytes[i] > sizeof(type) * chunk * 2) throw std::runtime_error("table " + signature() + " has a bad chunk");
+			data[i].resize(bytes[i]);
+			in.read(&data[i][0], bytes[i]);
+		}
+		in.read(reinterpret_cast<char*>(&crc), sizeof(uint32_t));
+		if (!in) throw std::runtime_error("table " + signature() + " is truncated");
+		if (crc != crc32(check.data(), sizeof(uint32_t) * count))
+			throw std::runtime_error("table " + signature() + " fails the checksum");
+		std::atomic<bool> fail(false);
+		parallel(count, threads, [&](size_t i) {
+			size_t len = std::min(size_t(chunk), value.size() - i * chunk);
+			if (check[i] != crc32(data[i].data(), data[i].size())
+					|| !decode(data[i], value.data() + i * chunk, len)) fail = true;
+		});
+		if (fail) throw std::runtime_error("table " + signature() + " fails the checksum");
+		return in;
+	}
+
+	/**
+	 * the delta record of a weight file, which has the same descriptor as the table record
+	 *
+	 * uint64_t count      number of dirty pages
+	 * uint64_t index[]    the dirty pages
+	 * uint64_t bytes      encoded size of the entries
+	 * char     data[]     the entries of the dirty pages, concatenated and encoded as a sparse chunk
+	 *                     ('page' entries for each, while the last page of the table may be shorter)
+	 * uint32_t crc        CRC-32 of index[] and data[]
+	 */
+	std::ostream& write_delta(std::ostream& out) const {
+		std::vector<uint64_t> index;
+		table buf;
+		for (size_t p = 0; p < pages(); p++) {
+			if (!touched(p)) continue;
+			index.push_back(p);
+			buf.insert(buf.end(), value.begin() + p * page, value.begin() + std::min(size(), (p + 1) * page));
+		}
+		std::string data;
+		encode(buf.data(), buf.size(), data);
+		uint64_t count = index.size(), bytes = data.size();
+		uint32_t crc = crc32(data.data(), bytes, crc32(index.data(), sizeof(uint64_t) * count));
+		describe(out);
+		out.write(reinterpret_cast<const char*>(&count), sizeof(uint64_t));
+		out.write(reinterpret_cast<const char*>(index.data()), sizeof(uint64_t) * count);
+		out.write(reinterpret_cast<const char*>(&bytes), sizeof(uint64_t));
+		out.write(data.data(), bytes);
+		out.write(reinterpret_cast<const char*>(&crc), sizeof(uint32_t));
 		return out;
 	}
-	friend std::istream& operator >>(std::istream& in, weight& w) {
-		auto& value = w.value;
+
+	/**
+	 * apply a delta record onto this table, whose descriptor must match the record
+	 * the patched pages are marked as dirty, so that the next delta still covers them
+	 */
+	std::istream& patch(std::istream& in) {
+		std::vector<unsigned> cells;
+		unsigned base = 0;
+		uint64_t size = describe(in, cells, base), count = 0, bytes = 0;
+		if (cells != this->cells || base != this->base || size != this->size())
+			throw std::runtime_error("delta table " + signature(cells, base, size) + " does not match " + signature());
+		in.read(reinterpret_cast<char*>(&count), sizeof(uint64_t));
+		if (!in || count > pages()) throw std::runtime_error("delta table " + signature() + " has bad pages");
+		std::vector<uint64_t> index(count);
+		in.read(reinterpret_cast<char*>(index.data()), sizeof(uint64_t) * count);
+		in.read(reinterpret_cast<char*>(&bytes), sizeof(uint64_t));
+		if (!in || bytes > sizeof(type) * size * 2) throw std::runtime_error("delta table " + signature() + " is truncated");
+		std::string data(bytes, '\0');
+		uint32_t crc = 0;
+		in.read(&data[0], bytes);
+		in.read(reinterpret_cast<char*>(&crc), sizeof(uint32_t));
+		if (!in) throw std::runtime_error("delta table " + signature() + " is truncated");
+		if (crc != crc32(data.data(), bytes, crc32(index.data(), sizeof(uint64_t) * count)))
+			throw std::runtime_error("delta table " + signature() + " fails the checksum");
+		size_t len = 0;
+		for (uint64_t p : index) {
+			if (p >= pages()) throw std::runtime_error("delta table " + signature() + " has bad pages");
+			len += std::min(size_t(page), size - p * page);
+		}
+		table buf(len);
+		if (!decode(data, buf.data(), len)) throw std::runtime_error("delta table " + signature() + " fails to decode");
+		auto it = buf.begin();
+		for (uint64_t p : index) {
+			size_t n = std::min(size_t(page), size - p * page);
+			std::copy(it, it + n, value.begin() + p * page);
+			dirty[p / 64] |= uint64_t(1) << (p % 64);
+			it += n;
+		}
+		return in;
+	}
+
+	friend std::ostream& operator <<(std::ostream& out, const weight& w) { return w.write(out); }
+	friend std::istream& operator >>(std::istream& in, weight& w) { return w.read(in); }
+
+	/**
+	 * read a table in the legacy format, which is a bare uint64_t size followed by the entries
+	 */
+	static weight legacy(std::istream& in) {
+		weight w;
 		uint64_t size = 0;
 		in.read(reinterpret_cast<char*>(&size), sizeof(uint64_t));
-		value.resize(size);
-		in.read(reinterpret_cast<char*>(value.data()), sizeof(type) * size);
-		return in;
+		if (!in || size > (uint64_t(1) << 40)) throw std::runtime_error("bad legacy table size");
+		table(size).swap(w.value);
+		w.clean();
+		in.read(reinterpret_cast<char*>(w.value.data()), sizeof(type) * size);
+		if (!in) throw std::runtime_error("legacy table is truncated");
+		return w;
+	}
+
+	/**
+	 * take the entries of a legacy table while keeping the own descriptor
+	 */
+	void adopt(weight&& w) {
+		value = std::move(w.value);
+		clean();
+	}
+
+private:
+	/**
+	 * copy the cells into the fixed-size array read by indexof()
+	 */
+	void locate() {
+		if (cells.size() > 16) throw std::invalid_argument("bad pattern length " + std::to_string(cells.size()));
+		length = cells.size();
+		at.fill(0);
+		std::copy(cells.begin(), cells.end(), at.begin());
+	}
+
+	/**
+	 * write or read the descriptor of a table record, and return the size on reading
+	 */
+	void describe(std::ostream& out) const {
+		uint32_t base = this->base, length = cells.size();
+		uint64_t size = value.size();
+		out.write(reinterpret_cast<const char*>(&base), sizeof(uint32_t));
+		out.write(reinterpret_cast<const char*>(&length), sizeof(uint32_t));
+		for (uint32_t cell : cells) out.write(reinterpret_cast<const char*>(&cell), sizeof(uint32_t));
+		out.write(reinterpret_cast<const char*>(&size), sizeof(uint64_t));
+	}
+	static uint64_t describe(std::istream& in, std::vector<unsigned>& cells, unsigned& base) {
+		uint32_t radix = 0, length = 0;
+		uint64_t size = 0;
+		in.read(reinterpret_cast<char*>(&radix), sizeof(uint32_t));
+		in.read(reinterpret_cast<char*>(&length), sizeof(uint32_t));
+		if (!in || length > 16) throw std::runtime_error("bad pattern length " + std::to_string(length));
+		cells.resize(length);
+		for (unsigned& cell : cells) {
+			uint32_t v = 0;
+			in.read(reinterpret_cast<char*>(&v), sizeof(uint32_t));
+			if (v >= 16) throw std::runtime_error("bad pattern cell " + std::to_string(v));
+			cell = v;
+		}
+		base = radix;
+		in.read(reinterpret_cast<char*>(&size), sizeof(uint64_t));
+		if (!in || (length && size != capacity(length, base)) || size > (uint64_t(1) << 40))
+			throw std::runtime_error("table " + signature(cells, base, size) + " has " + std::to_string(size) + " entries");
+		return size;
+	}
+
+	/**
+	 * encode entries as tokens of varint(zero run), varint(literal run), literals...
+	 * where zero means all bits clear, so that -0 is kept as a literal
+	 */
+	static void encode(const type* src, size_t len, std::string& dst) {
+		auto zero = [&](size_t i) { uint32_t v; std::memcpy(&v, src + i, sizeof(v)); return v == 0; };
+		for (size_t i = 0; i < len; ) {
+			size_t z = i, l;
+			while (z < len && zero(z)) z++;
+			for (l = z; l < len && !zero(l); l++);
+			varint(dst, z - i);
+			varint(dst, l - z);
+			dst.append(reinterpret_cast<const char*>(src + z), sizeof(type) * (l - z));
+			i = l;
+		}
+	}
+	/**
+	 * decode tokens into zero-initialized entries, return false if the tokens do not fit
+	 */
+	static bool decode(const std::string& src, type* dst, size_t len) {
+		const char* p = src.data();
+		const char* end = p + src.size();
+		size_t i = 0;
+		while (p < end) {
+			uint64_t z, l;
+			if (!varint(p, end, z) || !varint(p, end, l)) return false;
+			if (z > len - i || l > len - i - z || uint64_t(end - p) < sizeof(type) * l) return false;
+			i += z;
+			std::memcpy(dst + i, p, sizeof(type) * l);
+			p += sizeof(type) * l;
+			i += l;
+		}
+		return i == len;
+	}
+	static void varint(std::string& dst, uint64_t v) {
+		for (; v >= 0x80; v >>= 7) dst.push_back(char(v | 0x80));
+		dst.push_back(char(v));
+	}
+	static bool varint(const char*& p, const char* end, uint64_t& v) {
+		v = 0;
+		for (unsigned shift = 0; p < end && shift < 64; shift += 7) {
+			unsigned char c = *p++;
+			v |= uint64_t(c & 0x7f) << shift;
+			if (!(c & 0x80)) return true;
+		}
+		return false;
+	}
+
+	/**
+	 * run job(i) for i in [0, count) by the given number of threads
+	 */
+	template<typename job>
+	static void parallel(size_t count, unsigned threads, job&& work) {
+		std::atomic<size_t> next(0);
+		auto loop = [&]() { for (size_t i; (i = next++) < count; ) work(i); };
+		std::vector<std::thread> pool;
+		for (unsigned t = 1; t < std::min<size_t>(threads, count); t++) pool.emplace_back(loop);
+		loop();
+		for (std::thread& th : pool) th.join();
+	}
+
+	static std::vector<std::array<uint32_t, 256>> crc32_table() {
+		std::vector<std::array<uint32_t, 256>> table(8);
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t c = i;
+			for (int k = 0; k < 8; k++) c = (c & 1) ? (0xedb88320u ^ (c >> 1)) : (c >> 1);
+			table[0][i] = c;
+		}
+		for (uint32_t i = 0; i < 256; i++) {
+			for (int t = 1; t < 8; t++) table[t][i] = (table[t - 1][i] >> 8) ^ table[0][table[t - 1][i] & 0xff];
+		}
+		return table;
 	}
 
 protected:
-	std::vector<type> value;
+	table value;
+	std::vector<uint64_t> dirty;
+	std::vector<unsigned> cells;
+	unsigned base;
+	unsigned length; // the number of cells in at
+	std::array<unsigned char, 16> at; // the cells of the pattern
 };